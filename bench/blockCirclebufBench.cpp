@@ -0,0 +1,294 @@
+/*
+ * Microbenchmarks for BlockCirclebuf's hot paths, with libobs' circlebuf as
+ * the baseline wherever it has an equivalent and libobs is available. Each
+ * case runs for a fixed time and reports nanoseconds per operation and, for
+ * cases that move data, throughput. Usage:
+ *
+ *	blockCirclebufBench [buffer MiB] [seconds per case]
+ */
+#include "blockCirclebuf.hpp"
+
+#ifdef HAVE_OBS_CIRCLEBUF
+#include <util/circlebuf.h>
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <random>
+#include <vector>
+
+using namespace ReplayWorkbench;
+
+typedef BlockCirclebuf<uint8_t> ByteBuffer;
+typedef std::chrono::steady_clock Clock;
+
+static const size_t chunkSizes[] = {188, 4096, 64 * 1024, 1024 * 1024,
+				    1920 * 1080 * 3 / 2};
+
+struct Result {
+	uint64_t ops;
+	uint64_t bytes;
+	double seconds;
+};
+
+static double secondsSince(Clock::time_point start)
+{
+	return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+static void printHeader()
+{
+	printf("%-30s %-14s %12s %10s\n", "case", "implementation", "ns/op",
+	       "GB/s");
+}
+
+static void report(const char *name, const char *implementation,
+		   const Result &result)
+{
+	printf("%-30s %-14s %12.1f", name, implementation,
+	       result.seconds * 1e9 / result.ops);
+	if (result.bytes > 0)
+		printf(" %10.2f", result.bytes / result.seconds / 1e9);
+	printf("\n");
+}
+
+/*
+ * Calls `op' in batches until `seconds' have passed. `op' returns the number
+ * of bytes it moved.
+ */
+template<typename Op> static Result runFor(double seconds, Op op)
+{
+	Result result = {0, 0, 0};
+	Clock::time_point start = Clock::now();
+	do {
+		for (int i = 0; i < 16; i++)
+			result.bytes += op();
+		result.ops += 16;
+		result.seconds = secondsSince(start);
+	} while (result.seconds < seconds);
+	return result;
+}
+
+static void benchWrite(size_t bufferBytes, double seconds)
+{
+	for (size_t chunk : chunkSizes) {
+		std::vector<uint8_t> data(chunk, 0x5a);
+		char name[64];
+		snprintf(name, sizeof(name), "write %zu B", chunk);
+
+		{
+			ByteBuffer buffer(bufferBytes);
+			report(name, "BlockCirclebuf", runFor(seconds, [&]() {
+				       buffer.write(data.data(), chunk);
+				       return chunk;
+			       }));
+		}
+
+#ifdef HAVE_OBS_CIRCLEBUF
+		//keep the circlebuf at a fixed size, as a ring would be:
+		struct circlebuf circlebuf;
+		circlebuf_init(&circlebuf);
+		circlebuf_reserve(&circlebuf, bufferBytes);
+		report(name, "circlebuf", runFor(seconds, [&]() {
+			       if (circlebuf.size + chunk > bufferBytes)
+				       circlebuf_pop_front(
+					       &circlebuf, NULL,
+					       circlebuf.size + chunk -
+						       bufferBytes);
+			       circlebuf_push_back(&circlebuf, data.data(),
+						   chunk);
+			       return chunk;
+		       }));
+		circlebuf_free(&circlebuf);
+#endif
+	}
+}
+
+/*
+ * Reads are timed on their own: the buffer is refilled, untimed, whenever it
+ * runs dry.
+ */
+static void benchRead(size_t bufferBytes, double seconds)
+{
+	for (size_t chunk : chunkSizes) {
+		std::vector<uint8_t> fill(bufferBytes, 0x5a);
+		std::vector<uint8_t> out(chunk);
+		char name[64];
+		snprintf(name, sizeof(name), "read %zu B", chunk);
+
+		{
+			ByteBuffer buffer(bufferBytes);
+			Result result = {0, 0, 0};
+			while (result.seconds < seconds) {
+				buffer.write(fill.data(), bufferBytes);
+				Clock::time_point start = Clock::now();
+				while (buffer.bufferHealth() >= chunk) {
+					buffer.read(out.data(), chunk);
+					result.ops++;
+					result.bytes += chunk;
+				}
+				result.seconds += secondsSince(start);
+			}
+			report(name, "BlockCirclebuf", result);
+		}
+
+#ifdef HAVE_OBS_CIRCLEBUF
+		struct circlebuf circlebuf;
+		circlebuf_init(&circlebuf);
+		circlebuf_reserve(&circlebuf, bufferBytes);
+		Result result = {0, 0, 0};
+		while (result.seconds < seconds) {
+			circlebuf_push_back(&circlebuf, fill.data(),
+					    bufferBytes);
+			Clock::time_point start = Clock::now();
+			while (circlebuf.size >= chunk) {
+				circlebuf_pop_front(&circlebuf, out.data(),
+						    chunk);
+				result.ops++;
+				result.bytes += chunk;
+			}
+			result.seconds += secondsSince(start);
+			circlebuf_pop_front(&circlebuf, NULL, circlebuf.size);
+		}
+		report(name, "circlebuf", result);
+		circlebuf_free(&circlebuf);
+#endif
+	}
+}
+
+/*
+ * Splits a fresh block at `splits' random points, then merges the pieces
+ * back together again, timing each half separately.
+ */
+static void benchSplitReconcile(size_t bufferBytes, double seconds)
+{
+	static const size_t splits = 4096;
+	ByteBuffer buffer(bufferBytes);
+	ByteBuffer::Block *first = buffer.ptrAt(0).getBlock();
+
+	std::mt19937_64 rng(1);
+	std::vector<size_t> offsets(splits);
+	for (size_t &offset : offsets)
+		offset = 1 + rng() % (bufferBytes - 1);
+	std::sort(offsets.begin(), offsets.end());
+	offsets.erase(std::unique(offsets.begin(), offsets.end()),
+		      offsets.end());
+
+	Result split = {0, 0, 0};
+	Result reconcile = {0, 0, 0};
+	std::vector<ByteBuffer::Block *> blocks;
+	while (split.seconds < seconds) {
+		Clock::time_point start = Clock::now();
+		ByteBuffer::Block *block = first;
+		for (size_t offset : offsets) {
+			block->split(first->getStartPtr() + offset);
+			block = block->getNext();
+		}
+		split.seconds += secondsSince(start);
+		split.ops += offsets.size();
+
+		blocks.clear();
+		for (block = first->getNext(); block != first;
+		     block = block->getNext())
+			blocks.push_back(block);
+
+		start = Clock::now();
+		for (size_t i = blocks.size(); i > 0; i--)
+			blocks[i - 1]->attemptReconcilePrev();
+		reconcile.seconds += secondsSince(start);
+		reconcile.ops += blocks.size();
+	}
+	report("split", "BlockCirclebuf", split);
+	report("attemptReconcilePrev", "BlockCirclebuf", reconcile);
+}
+
+/*
+ * Measures position arithmetic on a half-full buffer cut into an increasing
+ * number of blocks.
+ */
+static void benchPtrDifference(size_t bufferBytes, double seconds)
+{
+	static const size_t blockCounts[] = {1, 64, 4096};
+	std::vector<uint8_t> fill(bufferBytes, 0x5a);
+	for (size_t blockCount : blockCounts) {
+		ByteBuffer::Config config;
+		config.blockCount = blockCount;
+		ByteBuffer buffer(bufferBytes, config);
+		buffer.write(fill.data(), bufferBytes / 2);
+
+		ByteBuffer::BCPtr from = buffer.ptrAt(0);
+		ByteBuffer::BCPtr to = buffer.ptrAt(bufferBytes / 2);
+		volatile size_t sink = 0;
+		char name[64];
+		snprintf(name, sizeof(name), "ptrDifference %zu blocks",
+			 blockCount);
+		report(name, "BlockCirclebuf", runFor(seconds, [&]() {
+			       sink = sink + buffer.ptrDifference(from, to);
+			       return (size_t)0;
+		       }));
+
+		//locating a position walks the blocks, so fragmentation shows:
+		snprintf(name, sizeof(name), "ptrAt %zu blocks", blockCount);
+		report(name, "BlockCirclebuf", runFor(seconds, [&]() {
+			       sink = sink + buffer.ptrAt(bufferBytes / 4).getPos();
+			       return (size_t)0;
+		       }));
+	}
+}
+
+/*
+ * Protects a trailing range after every write and releases the oldest of
+ * the outstanding protections, as repeated clip saves would. Only the
+ * protect()/unprotect() calls are timed.
+ */
+static void benchProtectChurn(size_t bufferBytes, double seconds)
+{
+	static const size_t chunk = 64 * 1024;
+	static const size_t outstanding = 8;
+	ByteBuffer::Config config;
+	config.blockCount = 16;
+	ByteBuffer buffer(bufferBytes, config);
+	std::vector<uint8_t> data(chunk, 0x5a);
+	std::deque<ByteBuffer::Protection *> protections;
+	std::mt19937_64 rng(1);
+	uint64_t head = 0;
+	Result result = {0, 0, 0};
+	while (result.seconds < seconds) {
+		buffer.write(data.data(), chunk);
+		head += chunk;
+		uint64_t length = 1 + rng() % std::min(buffer.bufferHealth(),
+							bufferBytes / 64);
+
+		Clock::time_point start = Clock::now();
+		protections.push_back(buffer.protectRange(head - length, head));
+		if (protections.size() > outstanding) {
+			buffer.unprotect(protections.front());
+			protections.pop_front();
+		}
+		result.seconds += secondsSince(start);
+		result.ops++;
+	}
+	for (ByteBuffer::Protection *protection : protections)
+		buffer.unprotect(protection);
+	report("protect/unprotect churn", "BlockCirclebuf", result);
+}
+
+int main(int argc, char **argv)
+{
+	size_t bufferMiB = argc > 1 ? strtoul(argv[1], NULL, 10) : 64;
+	double seconds = argc > 2 ? atof(argv[2]) : 0.5;
+	size_t bufferBytes = bufferMiB * 1024 * 1024;
+
+	printf("%zu MiB buffers, %.1f s per case\n\n", bufferMiB, seconds);
+	printHeader();
+	benchWrite(bufferBytes, seconds);
+	benchRead(bufferBytes, seconds);
+	benchSplitReconcile(bufferBytes, seconds);
+	benchPtrDifference(bufferBytes, seconds);
+	benchProtectChurn(bufferBytes, seconds);
+	return 0;
+}
@@ -0,0 +1,148 @@
+/*
+ * Measures how much a thread writing raw frames into a large ring slows down
+ * a concurrently running, cache-sensitive workload, with the frames copied by
+ * memcpy() versus streamingCopy().
+ *
+ * The workload chases pointers around a random cycle through a working set
+ * sized to sit in the last-level cache, so every line the writer evicts costs
+ * it a trip to memory. Usage:
+ *
+ *	streamingCopyBench [working set MiB] [seconds per phase]
+ */
+#include "streamingCopy.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <numeric>
+#include <random>
+#include <thread>
+#include <vector>
+
+using namespace ReplayWorkbench;
+
+typedef void (*CopyFunction)(void *dest, const void *src, size_t bytes);
+
+static const size_t frameBytes = 3840 * 2160 * 3 / 2; //4K NV12
+static const size_t ringFrames = 32;
+static const size_t sourceFrames = 4;
+
+static void copyMemcpy(void *dest, const void *src, size_t bytes)
+{
+	memcpy(dest, src, bytes);
+}
+
+struct Phase {
+	const char *name;
+	CopyFunction copy;
+};
+
+struct PhaseResult {
+	double chaseStepsPerSecond;
+	double copyBytesPerSecond;
+};
+
+/*
+ * Builds a single random cycle through `count' slots, one per cache line, so
+ * the hardware prefetcher cannot help the chase.
+ */
+static std::vector<size_t> buildCycle(size_t count)
+{
+	static const size_t stride = 64 / sizeof(size_t);
+	std::vector<size_t> order(count);
+	std::iota(order.begin(), order.end(), 0);
+	std::shuffle(order.begin() + 1, order.end(), std::mt19937_64(1));
+
+	std::vector<size_t> slots(count * stride);
+	for (size_t i = 0; i < count; i++)
+		slots[order[i] * stride] = order[(i + 1) % count] * stride;
+	return slots;
+}
+
+static PhaseResult runPhase(const Phase &phase, std::vector<size_t> &slots,
+			    std::vector<char> &ring,
+			    std::vector<char> &sources, double seconds)
+{
+	std::atomic<bool> stop(false);
+	std::atomic<uint64_t> bytesCopied(0);
+
+	std::thread writer;
+	if (phase.copy) {
+		writer = std::thread([&]() {
+			size_t frame = 0;
+			while (!stop.load(std::memory_order_relaxed)) {
+				phase.copy(ring.data() +
+						   (frame % ringFrames) *
+							   frameBytes,
+					   sources.data() +
+						   (frame % sourceFrames) *
+							   frameBytes,
+					   frameBytes);
+				bytesCopied.fetch_add(
+					frameBytes, std::memory_order_relaxed);
+				frame++;
+			}
+		});
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	auto end = start + std::chrono::duration<double>(seconds);
+	uint64_t steps = 0;
+	size_t slot = 0;
+	while (std::chrono::steady_clock::now() < end) {
+		for (int i = 0; i < 4096; i++)
+			slot = slots[slot];
+		steps += 4096;
+	}
+	double elapsed = std::chrono::duration<double>(
+				 std::chrono::steady_clock::now() - start)
+				 .count();
+
+	stop = true;
+	if (writer.joinable())
+		writer.join();
+
+	//keep the chase from being optimised away:
+	if (slot == (size_t)-1)
+		printf("\n");
+
+	return {steps / elapsed, bytesCopied.load() / elapsed};
+}
+
+int main(int argc, char **argv)
+{
+	size_t workingSetMiB = argc > 1 ? strtoul(argv[1], NULL, 10) : 4;
+	double seconds = argc > 2 ? atof(argv[2]) : 2.0;
+
+	std::vector<size_t> slots = buildCycle(workingSetMiB * 1024 * 1024 / 64);
+	std::vector<char> ring(ringFrames * frameBytes, 1);
+	std::vector<char> sources(sourceFrames * frameBytes, 2);
+
+	printf("streamingCopy kernel: %s\n", streamingCopyKernelName());
+	printf("working set %zu MiB, %zu byte frames, %.1f s per phase\n\n",
+	       workingSetMiB, frameBytes, seconds);
+
+	const Phase phases[] = {{"workload alone", NULL},
+				{"memcpy writer", copyMemcpy},
+				{"streaming writer", streamingCopy}};
+
+	double baseline = 0;
+	printf("%-18s %14s %10s %12s\n", "phase", "chase Msteps/s",
+	       "vs alone", "copy GB/s");
+	for (const Phase &phase : phases) {
+		PhaseResult result =
+			runPhase(phase, slots, ring, sources, seconds);
+		if (!phase.copy)
+			baseline = result.chaseStepsPerSecond;
+		printf("%-18s %14.1f %9.1f%% %12.2f\n", phase.name,
+		       result.chaseStepsPerSecond / 1e6,
+		       100.0 * result.chaseStepsPerSecond / baseline,
+		       result.copyBytesPerSecond / 1e9);
+	}
+
+	return 0;
+}
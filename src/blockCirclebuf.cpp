@@ -1,35 +1,75 @@
 #pragma once
 #include "blockCirclebuf.hpp"
+#include "coreHooks.hpp"
+#include <algorithm>
 #include <cstdio>
 #include <cstring>
+#include <new>
 #include <stdexcept>
-#include <util/base.h>
-#include <util/bmem.h>
+#include <type_traits>
 using namespace ReplayWorkbench;
 
+/*
+ * Allocates the memory for a superblock of `size' elements, and descriptors
+ * for its blocks, without adding it to the buffer.
+ */
+template<typename T>
+typename BlockCirclebuf<T>::SuperblockAllocation *
+BlockCirclebuf<T>::newSuperblockAllocation(size_t size)
+{
+	blockPool.grow(size * sizeof(T));
+	SuperblockAllocation *superblock = new SuperblockAllocation(
+		allocateSuperblockMemory(size * sizeof(T), config.hugePages,
+					 config.lockMemory,
+					 config.backingDirectory.c_str()),
+		size, this);
+	Traits::construct(superblock->allocationStart, size);
+	return superblock;
+}
+
+template<typename T>
+typename BlockCirclebuf<T>::SuperblockAllocation *
+BlockCirclebuf<T>::addSuperblockAllocation(size_t size)
+{
+	//take the spare if it fits, rather than allocate on the writer's path:
+	SuperblockAllocation *superblock = spareSuperblock;
+	if (superblock && superblock->allocationLength == size)
+		spareSuperblock = NULL;
+	else
+		superblock = newSuperblockAllocation(size);
+	superblockAllocations.push_back(superblock);
+	capacity += size;
+	return superblock;
+}
+
+/*
+ * Frees a superblock no longer in the ring, or never added to it.
+ */
+template<typename T>
+void BlockCirclebuf<T>::freeSuperblock(SuperblockAllocation *superblock)
+{
+	Traits::destroy(superblock->allocationStart,
+			superblock->allocationLength);
+	freeSuperblockMemory(superblock->memory);
+	delete superblock;
+}
+
 template<typename T>
 typename BlockCirclebuf<T>::Block *
 BlockCirclebuf<T>::allocateSuperblock(size_t size)
 {
-	Block *firstBlock = bmalloc(sizeof(Block));
-	superblockAllocations.push_back(
-		SuperblockAllocation((T *)bmalloc(size * sizeof(T))));
-	SuperblockAllocation &alloc = superblockAllocations.back();
-	*firstBlock = Block(*alloc, alloc.allocationStart, size);
-	return firstBlock;
+	SuperblockAllocation *alloc = addSuperblockAllocation(size);
+	return new (blockPool.allocate())
+		Block(alloc, alloc->allocationStart, size);
 }
 
 template<typename T>
-void BlockCirclebuf<T>::allocateSuperblock(size_t size, Block *prev,
-					   Block *next)
+typename BlockCirclebuf<T>::Block *
+BlockCirclebuf<T>::allocateSuperblock(size_t size, Block *prev, Block *next)
 {
-	Block *firstBlock = bmalloc(sizeof(Block));
-	superblockAllocations.push_back(
-		SuperblockAllocation((T *)bmalloc(size * sizeof(T))));
-	SuperblockAllocation &alloc = superblockAllocations.back();
-	&firstBlock = Block(*alloc, alloc.allocationStart, size, prev, next);
-	prev->next = firstBlock;
-	next->prev = firstBlock;
+	SuperblockAllocation *alloc = addSuperblockAllocation(size);
+	return new (blockPool.allocate())
+		Block(alloc, alloc->allocationStart, size, prev, next);
 }
 
 template<typename T>
@@ -45,11 +85,15 @@ BlockCirclebuf<T>::Block::Block(SuperblockAllocation *parentSuperblock,
 	next->prev = this;
 	this->prev = prev;
 	prev->next = this;
-	this->writeProtect = false;
+	this->protectCount = 0;
+	this->cowCount = 0;
 	this->readProtect = false;
 	this->willReconcileNext = false;
 	this->willReconcilePrev = false;
 	referencingPtrs = NULL;
+	lastWritePos = 0;
+	firstWritePos.store(UINT64_MAX, std::memory_order_relaxed);
+	addRelaxed(parentSuperblock->owner->writerCounters.blockCount, 1);
 }
 
 template<typename T>
@@ -61,48 +105,40 @@ BlockCirclebuf<T>::Block::Block(SuperblockAllocation *parentSuperblock,
 
 template<typename T> void BlockCirclebuf<T>::Block::split(T *splitPoint)
 {
-	Block *newBlock = (Block *)bmalloc(sizeof(Block));
 	if (splitPoint < blockStart || splitPoint > blockStart + blockLength)
 		throw std::out_of_range(
 			"Tried to split a BlockCirclebuf block at an out-of-range splitPoint");
-	//if ((splitPoint - blockStart) % sizeof(T) != 0)
-	//	throw std::runtime_error(
-	//		"Tried to split a BlockCirclebuf at a misaligned location");
 
-	&newBlock = (parentSuperblock, splitPoint,
-		     blockLength - (splitPoint - blockStart), this, next);
-	newBlock->writeProtect = writeProtect;
+	//splitting on an existing boundary is a no-op:
+	if (splitPoint == blockStart || splitPoint == blockStart + blockLength)
+		return;
+
+	Latencies *latencies = parentSuperblock->owner->latencies;
+	LatencyTimer timer(latencies ? &latencies->split : NULL);
+	Block *newBlock = new (parentSuperblock->owner->blockPool.allocate())
+		Block(parentSuperblock, splitPoint,
+		      blockLength - (splitPoint - blockStart), this, next);
+	newBlock->protectCount = protectCount;
+	newBlock->cowCount = cowCount;
 	newBlock->readProtect = readProtect;
+	newBlock->lastWritePos = lastWritePos;
+	uint64_t first = firstWritePos.load(std::memory_order_relaxed);
+	if (first != UINT64_MAX)
+		newBlock->firstWritePos.store(first + (splitPoint - blockStart),
+					      std::memory_order_relaxed);
 	blockLength = blockLength - newBlock->blockLength;
-	next->prev = newBlock;
-	next = newBlock;
+	addRelaxed(parentSuperblock->owner->writerCounters.splits, 1);
 
-	//update all pointers after the split:
+	//update all pointers after the split. Logical positions are unaffected
+	//as no data moves.
 	BCPtr *currentBCPtr = this->referencingPtrs;
 	BCPtr *nextBCPtr;
 	while (currentBCPtr) {
-		if (currentBCPtr->ptr < splitPoint) {
-			currentBCPtr = currentBCPtr->next;
-			continue;
-		}
-
 		nextBCPtr = currentBCPtr->next;
-
-		if (currentBCPtr->next)
-			currentBCPtr->next->prev = currentBCPtr->prev;
-		if (currentBCPtr->prev)
-			currentBCPtr->prev->next = currentBCPtr->next;
-
-		currentBCPtr->block = newBlock;
-		currentBCPtr->next = newBlock->referencingPtrs;
-		if (newBlock->referencingPtrs)
-			newBlock->referencingPtrs->prev = newBlock;
-		newBlock->referencingPtrs = newBlock;
-
+		if (currentBCPtr->ptr >= splitPoint)
+			currentBCPtr->moveTo(newBlock, currentBCPtr->ptr);
 		currentBCPtr = nextBCPtr;
 	}
-	if (newBlock->referencingPtrs)
-		newBlock->referencingPtrs->prev = NULL;
 }
 
 template<typename T> void BlockCirclebuf<T>::Block::split(BCPtr &splitPoint)
@@ -113,35 +149,217 @@ template<typename T> void BlockCirclebuf<T>::Block::split(BCPtr &splitPoint)
 	split(splitPoint.ptr);
 }
 
-template<typename T> BlockCirclebuf<T>::BlockCirclebuf(size_t size)
+/*
+ * Stops the head overwriting this block. Once the head passes it the block is
+ * also excluded from the live stream, until unprotected. Protections are
+ * counted, so overlapping exports can each hold the block, and every call
+ * must be paired with an unprotect().
+ */
+template<typename T> void BlockCirclebuf<T>::Block::protect()
+{
+	if (protectCount++ == 0)
+		parentSuperblock->owner->protectedLength += blockLength;
+}
+
+/*
+ * Drops one protection of this block. Once none are left the block is
+ * returned to the writer and merged back into its neighbours, deferred until
+ * the head next passes if it is still excluded. The owner's layout stats are
+ * left to the caller. `this' may not be valid afterwards.
+ */
+template<typename T> void BlockCirclebuf<T>::Block::unprotect()
+{
+	if (protectCount == 0 || --protectCount > 0)
+		return;
+	parentSuperblock->owner->protectedLength -= blockLength;
+	reconcileReleased();
+}
+
+/*
+ * unprotect() for a copy-on-write hold. `this' may not be valid afterwards.
+ */
+template<typename T> void BlockCirclebuf<T>::Block::releaseCopyOnWrite()
+{
+	if (cowCount == 0 || --cowCount > 0)
+		return;
+	reconcileReleased();
+}
+
+/*
+ * Merges a block nothing holds any more with the next one and then the one
+ * before, as far as they allow.
+ */
+template<typename T> void BlockCirclebuf<T>::Block::reconcileReleased()
+{
+	BlockCirclebuf *owner = parentSuperblock->owner;
+	if (owner->config.concurrent)
+		return;
+	owner->reconcileOrDefer(next);
+	owner->reconcileOrDefer(this);
+}
+
+template<typename T> bool BlockCirclebuf<T>::Block::isProtected()
+{
+	return protectCount > 0;
+}
+
+template<typename T>
+BlockCirclebuf<T>::BlockCirclebuf(size_t size, const Config &config)
+	: config(config),
+	  spareSuperblock(NULL),
+	  capacity(0),
+	  protectedLength(0),
+	  reconcilePending(false),
+	  publishedHeadPos(0),
+	  writerCounters(),
+	  nextStatsLog(std::chrono::steady_clock::now() +
+		       config.statsLogInterval),
+	  publishedTailPos(0),
+	  readerCounters(),
+	  nextLeaseExpiry(std::chrono::steady_clock::time_point::max()),
+	  latencies(config.recordLatency ? new Latencies() : NULL)
 {
 	Block *firstBlock;
 	firstBlock = allocateSuperblock(size);
+	baseCapacity = capacity;
+	loggedCapacity = capacity;
+	for (size_t i = config.blockCount - 1; i > 0; i--)
+		firstBlock->split(firstBlock->getStartPtr() +
+				  i * (size / config.blockCount));
+
 	head = BCPtr(firstBlock, firstBlock->getStartPtr());
 	tail = BCPtr(firstBlock, firstBlock->getStartPtr());
+
+	//in concurrent mode head and tail each belong to a single thread, so
+	//must not share the blocks' referencingPtrs lists:
+	if (config.concurrent) {
+		head.detach();
+		tail.detach();
+	}
+
+	layoutChanged();
+	prepareGrowth();
 }
 
-template<typename T> size_t BlockCirclebuf<T>::ptrDifference(BCPtr &a, BCPtr &b)
+/*
+ * Block descriptors go with the pool; BCPtrs still held by the caller must not
+ * be used afterwards.
+ */
+template<typename T> BlockCirclebuf<T>::~BlockCirclebuf()
 {
-	size_t accumulator = 0;
-	BCPtr currentPosn(a);
-	while (currentPosn.block != b.block || currentPosn.ptr < b.ptr) {
-		accumulator +=
-			(currentPosn.block->getLength()) -
-			(currentPosn.ptr - currentPosn.block.getStartPtr());
-		currentPosn.ptr = currentPosn.block->getNext().getStartPtr();
-		currentPosn.block = currentPosn.block->getNext();
-	}
+	for (Reader *reader : readers)
+		delete reader;
+	for (Snapshot *snapshot : snapshots)
+		delete snapshot;
+	for (Protection *protection : protections)
+		delete protection;
+	delete latencies;
+
+	for (SuperblockAllocation *superblock : superblockAllocations)
+		freeSuperblock(superblock);
+	for (SuperblockAllocation *superblock : retiredSuperblocks)
+		freeSuperblock(superblock);
+	if (spareSuperblock)
+		freeSuperblock(spareSuperblock);
+}
+
+/*
+ * Superblocks in allocation order, e.g. to report which memory mode each
+ * actually got.
+ */
+template<typename T>
+const std::vector<typename BlockCirclebuf<T>::SuperblockAllocation *> &
+BlockCirclebuf<T>::getSuperblocks()
+{
+	return superblockAllocations;
+}
 
-	accumulator += b.ptr - a.ptr;
-	return accumulator;
+/*
+ * Number of elements in the live stream from `a' up to `b'. `a' must not be
+ * logically ahead of `b'.
+ */
+template<typename T> size_t BlockCirclebuf<T>::ptrDifference(BCPtr &a, BCPtr &b)
+{
+	return (size_t)(b.pos - a.pos);
 }
 
 template<typename T> size_t BlockCirclebuf<T>::bufferHealth()
 {
+	if (config.concurrent)
+		return (size_t)(publishedHeadPos.load(std::memory_order_acquire) -
+				publishedTailPos.load(std::memory_order_acquire));
 	return ptrDifference(tail, head);
 }
 
+template<typename T>
+typename BlockCirclebuf<T>::Stats BlockCirclebuf<T>::stats()
+{
+	const std::memory_order relaxed = std::memory_order_relaxed;
+	Stats result;
+	result.bytesWritten = writerCounters.written.load(relaxed) * sizeof(T);
+	result.bytesRead = readerCounters.read.load(relaxed) * sizeof(T);
+	result.bytesEvicted = writerCounters.evicted.load(relaxed) * sizeof(T);
+	result.tailOverruns = writerCounters.tailOverruns.load(relaxed);
+	result.protectedBlocksSkipped =
+		writerCounters.blocksSkipped.load(relaxed);
+	result.splits = writerCounters.splits.load(relaxed);
+	result.reconciles = writerCounters.reconciles.load(relaxed);
+	result.blockCount = writerCounters.blockCount.load(relaxed);
+	result.protectedBytes =
+		writerCounters.protectedLength.load(relaxed) * sizeof(T);
+	if (writerCounters.layoutChanged.exchange(false, relaxed))
+		updateLayoutStats();
+	result.largestFreeSpan =
+		writerCounters.largestFreeSpan.load(relaxed) * sizeof(T);
+	return result;
+}
+
+template<typename T> void BlockCirclebuf<T>::logStats()
+{
+	Stats current = stats();
+	coreLog(CORE_LOG_INFO,
+		"Replay buffer: %llu bytes written, %llu read, %llu evicted in %llu overruns; "
+		"%llu protected blocks skipped; %llu splits, %llu reconciles; "
+		"%zu blocks, %zu bytes protected, largest free span %zu bytes",
+		(unsigned long long)current.bytesWritten,
+		(unsigned long long)current.bytesRead,
+		(unsigned long long)current.bytesEvicted,
+		(unsigned long long)current.tailOverruns,
+		(unsigned long long)current.protectedBlocksSkipped,
+		(unsigned long long)current.splits,
+		(unsigned long long)current.reconciles, current.blockCount,
+		current.protectedBytes, current.largestFreeSpan);
+}
+
+template<typename T>
+typename BlockCirclebuf<T>::Latencies *BlockCirclebuf<T>::getLatencies()
+{
+	return latencies;
+}
+
+template<typename T> void BlockCirclebuf<T>::logLatencies()
+{
+	if (!latencies)
+		return;
+	latencies->write.log("write");
+	latencies->split.log("split");
+	latencies->protect.log("protect");
+	latencies->unprotect.log("unprotect");
+	latencies->protectionLifetime.log("protection lifetime");
+}
+
+/*
+ * Number of elements that may be consumed from the tail, as seen from the
+ * reader. Data a retaining reader has yet to read is never consumed.
+ */
+template<typename T> size_t BlockCirclebuf<T>::readable()
+{
+	if (config.concurrent)
+		return (size_t)(publishedHeadPos.load(std::memory_order_acquire) -
+				tail.pos);
+	return (size_t)(std::min(head.pos, evictionLimit()) - tail.pos);
+}
+
 template<typename T> size_t BlockCirclebuf<T>::Block::getLength()
 {
 	return blockLength;
@@ -164,165 +382,1966 @@ typename BlockCirclebuf<T>::Block *BlockCirclebuf<T>::Block::getPrev()
 	return prev;
 }
 
-template<typename T> void BlockCirclebuf<T>::write(T *input, size_t count)
+template<typename T>
+typename BlockCirclebuf<T>::WriteStatus BlockCirclebuf<T>::write(T *input,
+								 size_t count)
 {
+	LatencyTimer timer(latencies ? &latencies->write : NULL);
+
+	//turn away writes that could never fit before evicting anything:
+	if (config.overflowPolicy == OverflowPolicy::REJECT) {
+		if (!config.concurrent)
+			expireLeases();
+		if (count > writableCapacity())
+			return WriteStatus::REJECTED;
+	}
+
+	std::vector<Span> &spans = writeSpans;
 	size_t numRead = 0;
 	while (numRead < count) {
-		size_t numInCurrentBlock = std::min(
-			count - numRead,
-			head.block->getLength() -
-				(head.ptr - head.block->getStartPtr()));
-
-		//TODO: handle read protection
-		if (tail.block == head.block &&
-		    tail.ptr <= head.ptr + numInCurrentBlock) {
-			tail.ptr = head.ptr + numInCurrentBlock;
-			if (tail.ptr >= tail.block->getStartPtr() +
-						tail.block->getLength()) {
-				do {
-					tail.block = tail.block->getNext();
-					tail.ptr = tail.block->getStartPtr();
-				} while (tail.block->readProtect);
-			}
+		size_t numReserved = reserve(spans, count - numRead);
+		if (numReserved < count - numRead) {
+			//nothing has been published yet, as the first
+			//reservation only falls short if the buffer is full:
+			if (config.overflowPolicy == OverflowPolicy::REJECT)
+				return WriteStatus::REJECTED;
+			if (numReserved == 0)
+				break;
 		}
 
-		memcpy(head.ptr, input + numRead, numInCurrentBlock);
-		numRead += numInCurrentBlock;
-		head.ptr += numInCurrentBlock;
-		if (head.ptr >=
-		    head.block->getStartPtr() + head.block->getLength()) {
-			do {
-				head.block = head.block->getNext();
-				head.ptr = head.block->getStartPtr();
-				head.block.readProtect =
-					head.block.writeProtect;
-				if (!head.block.readProtect) {
-					if (head.block->willReconcilePrev)
-						head.block
-							->attemptReconcilePrev();
-
-					if (head.block->willReconcileNext)
-						head.block
-							->attemptReconcileNext();
-				}
+		for (Span &span : spans) {
+			Traits::copyIn(span.ptr, input + numRead, span.length);
+			numRead += span.length;
+		}
+		commit(numReserved);
+	}
+
+	return numRead == count ? WriteStatus::OK : WriteStatus::DROPPED;
+}
+
+template<typename T>
+typename BlockCirclebuf<T>::WriteStatus
+BlockCirclebuf<T>::write(T *input, size_t count, int64_t timestamp,
+			 bool keyframe)
+{
+	uint64_t pos = head.pos;
+	WriteStatus status = write(input, count);
+	if (status == WriteStatus::OK) {
+		timestampIndex.append(timestamp, pos);
+		if (keyframe)
+			keyframeIndex.append(pos);
+	}
+	trimIndices();
+	return status;
+}
+
+/*
+ * Drops index entries the tail has passed, as seen from the writer.
+ */
+template<typename T> void BlockCirclebuf<T>::trimIndices()
+{
+	uint64_t tailPos = config.concurrent ? publishedTailPos.load(
+						       std::memory_order_acquire)
+					     : tail.pos;
+	timestampIndex.trim(tailPos);
+	keyframeIndex.trim(tailPos);
+}
+
+template<typename T>
+bool BlockCirclebuf<T>::positionAt(int64_t timestamp, uint64_t &pos)
+{
+	trimIndices();
+	return timestampIndex.lookup(timestamp, pos);
+}
+
+template<typename T> TimestampIndex &BlockCirclebuf<T>::getTimestampIndex()
+{
+	return timestampIndex;
+}
+
+template<typename T> KeyframeIndex &BlockCirclebuf<T>::getKeyframeIndex()
+{
+	return keyframeIndex;
+}
+
+template<typename T>
+typename BlockCirclebuf<T>::Protection *
+BlockCirclebuf<T>::protectRange(uint64_t from, uint64_t to,
+				std::chrono::steady_clock::duration ttl)
+{
+	trimIndices();
+	uint64_t keyframePos;
+	if (keyframeIndex.previous(from, keyframePos) ||
+	    (keyframeIndex.next(from, keyframePos) && keyframePos < to))
+		from = keyframePos;
+
+	return protect(ptrAt(from), ptrAt(to), ttl);
+}
+
+template<typename T>
+typename BlockCirclebuf<T>::Protection *
+BlockCirclebuf<T>::protect(const BCPtr &begin, const BCPtr &end,
+			   std::chrono::steady_clock::duration ttl)
+{
+	LatencyTimer timer(latencies ? &latencies->protect : NULL);
+	Protection *protection = hold(begin, end, false);
+	if (latencies)
+		protection->heldSince = std::chrono::steady_clock::now();
+	if (ttl > std::chrono::steady_clock::duration::zero())
+		renew(protection, ttl);
+	return protection;
+}
+
+/*
+ * Splits at `begin' and `end' and holds the live blocks between them, either
+ * protecting them or, if `copyOnWrite', asking the writer to copy them aside
+ * before it overwrites them.
+ */
+template<typename T>
+typename BlockCirclebuf<T>::Protection *
+BlockCirclebuf<T>::hold(const BCPtr &begin, const BCPtr &end, bool copyOnWrite)
+{
+	if (begin.pos > end.pos)
+		throw std::out_of_range(
+			"Tried to protect a BlockCirclebuf range that ends before it begins");
+	//a BCPtr the head has since lapped no longer points at its data:
+	if (begin.pos < tail.pos || end.pos > head.pos)
+		throw std::out_of_range(
+			"Tried to protect a BlockCirclebuf range outside the live stream");
+
+	BCPtr rangeBegin = begin;
+	BCPtr rangeEnd = end;
+	rangeBegin.block->split(rangeBegin);
+	rangeEnd.block->split(rangeEnd);
 
-			} while (head.block->writeProtect);
+	std::vector<Block *> blocks;
+	blocksInRange(rangeBegin, rangeEnd, blocks);
+
+	//blocks already excluded from the live stream hold older data, and
+	//may belong to other protections, so split the range into runs of
+	//live blocks:
+	Protection *protection = new Protection(begin.pos, end.pos);
+	protection->copyOnWrite = copyOnWrite;
+	Block *runStart = NULL;
+	uint64_t runPos = 0;
+	uint64_t pos = begin.pos;
+	for (size_t i = 0; i <= blocks.size(); i++) {
+		bool live = i < blocks.size() && continuesIn(blocks[i], pos);
+		if (live) {
+			if (copyOnWrite)
+				blocks[i]->cowCount++;
+			else
+				blocks[i]->protect();
+			if (!runStart) {
+				runStart = blocks[i];
+				runPos = pos;
+			}
+			pos += blocks[i]->blockLength;
+		} else if (runStart) {
+			Block *runEnd = blocks[i - 1];
+			protection->runs.push_back(
+				{runPos, BCPtr(runStart, runStart->getStartPtr()),
+				 BCPtr(runEnd, runEnd->getStartPtr() +
+						       runEnd->getLength())});
+			runStart = NULL;
 		}
 	}
+
+	//a head split onto the start of what it now may not overwrite waits
+	//behind it instead:
+	if (!config.concurrent && head.block->protectCount > 0)
+		restHeadBehind();
+
+	protections.push_back(protection);
+	layoutChanged();
+	return protection;
 }
 
-template<typename T> bool BlockCirclebuf<T>::Block::attemptReconcileNext()
+template<typename T> void BlockCirclebuf<T>::unprotect(Protection *protection)
 {
-	return next->attemptReconcilePrev();
+	LatencyTimer timer(latencies ? &latencies->unprotect : NULL);
+	if (latencies)
+		latencies->protectionLifetime.record(
+			std::chrono::steady_clock::now() -
+			protection->heldSince);
+	dropProtection(protection);
 }
 
-template<typename T> bool BlockCirclebuf<T>::Block::attemptReconcilePrev()
+/*
+ * Releases a protection or snapshot's hold and frees its handle.
+ */
+template<typename T>
+void BlockCirclebuf<T>::dropProtection(Protection *protection)
 {
-	//fail if reconciling with self
-	if (prev == this)
-		return false;
+	releaseProtection(protection);
+	protections.erase(std::remove(protections.begin(), protections.end(),
+				      protection),
+			  protections.end());
+	delete protection;
+}
 
-	//fail if not in same superblock
-	if (prev->parentSuperblock != this->parentSuperblock)
+template<typename T>
+bool BlockCirclebuf<T>::renew(Protection *protection,
+			      std::chrono::steady_clock::duration ttl)
+{
+	if (protection->expired)
 		return false;
 
-	//fail if not physically adjacent
-	if (prev->blockStart + prev->blockLength != this->blockStart)
-		return false;
+	protection->leased = true;
+	protection->expiry = std::chrono::steady_clock::now() + ttl;
+	nextLeaseExpiry = std::min(nextLeaseExpiry, protection->expiry);
+	return true;
+}
 
-	//defer until read protection ends if either is read protected.
-	//(avoid merging in corrupted data/excluding good data)
-	if (this->readProtect || prev->readProtect) {
-		this->willReconcilePrev = true;
-		prev->willReconcileNext = true;
-		return false;
+/*
+ * Releases the blocks a protection holds, merging them back into their
+ * neighbours so repeated saves don't leave the ring fragmented. The handle
+ * is left holding nothing.
+ */
+template<typename T>
+void BlockCirclebuf<T>::releaseProtection(Protection *protection)
+{
+	std::vector<Block *> blocks;
+	for (typename Protection::Run &run : protection->runs) {
+		Block *block = run.first.block;
+		while (true) {
+			blocks.push_back(block);
+			if (block == run.last.block)
+				break;
+			block = block->getNext();
+		}
 	}
+	protection->runs.clear();
 
-	//perform reconciliation:
-	prev->writeProtect = this->writeProtect || prev->writeProtect;
-	prev->blockLength = prev->blockLength + this->blockLength;
-	prev->next = this->next;
-	this->next->prev = prev;
-	prev->willReconcileNext = false;
+	//release backwards, so each block merged into is still to be
+	//visited. A range wrapping the whole ring would have its first block
+	//merged into the last, so that one is pinned until its turn:
+	bool wraps = !blocks.empty() &&
+		     blocks.back()->getNext() == blocks.front();
+	if (wraps)
+		blocks.front()->cowCount++;
+	for (size_t i = blocks.size(); i > 0; i--) {
+		Block *block = blocks[i - 1];
+		if (wraps && i == 1)
+			block->cowCount--;
+		if (protection->copyOnWrite)
+			block->releaseCopyOnWrite();
+		else
+			block->unprotect();
+	}
 
-	//update all BCPtrs to point to newly reconciled block.
-	BCPtr *currentBCPtr;
-	while (this->referencingPtrs) {
-		currentBCPtr = this->referencingPtrs;
-		currentBCPtr->block = prev;
+	layoutChanged();
+}
+
+/*
+ * Merges `block' into its predecessor now, or under Config::deferReconcile
+ * just flags the pair for coalesce().
+ */
+template<typename T> void BlockCirclebuf<T>::reconcileOrDefer(Block *block)
+{
+	if (!config.deferReconcile) {
+		block->attemptReconcilePrev();
+		return;
+	}
+	block->willReconcilePrev = true;
+	block->prev->willReconcileNext = true;
+	reconcilePending = true;
+}
+
+template<typename T> size_t BlockCirclebuf<T>::coalesce(size_t maxMerges)
+{
+	if (config.concurrent || !reconcilePending)
+		return 0;
+	reconcilePending = false;
+
+	std::vector<Block *> candidates;
+	Block *block = head.block;
+	do {
+		if (block->willReconcilePrev || block->prev->willReconcileNext)
+			candidates.push_back(block);
+		block = block->next;
+	} while (block != head.block);
+
+	//a merge only frees the candidate merged, so the rest stay valid:
+	size_t numMerged = 0;
+	for (Block *candidate : candidates) {
+		if (numMerged == maxMerges) {
+			reconcilePending = true;
+			break;
+		}
+
+		Block *prev = candidate->prev;
+		if (candidate->attemptReconcilePrev()) {
+			numMerged++;
+		} else if (!candidate->readProtect && !prev->readProtect) {
+			//will never merge as things stand; anything that
+			//changes that flags the pair again:
+			candidate->willReconcilePrev = false;
+			prev->willReconcileNext = false;
+		}
+	}
+
+	return numMerged;
+}
+
+/*
+ * Releases every lease past its expiry, then works out when the next one is
+ * due. The clock is only read while leases are held.
+ */
+template<typename T> void BlockCirclebuf<T>::expireLeases()
+{
+	if (nextLeaseExpiry == std::chrono::steady_clock::time_point::max())
+		return;
+
+	std::chrono::steady_clock::time_point now =
+		std::chrono::steady_clock::now();
+	if (now < nextLeaseExpiry)
+		return;
+
+	nextLeaseExpiry = std::chrono::steady_clock::time_point::max();
+	for (Protection *protection : protections) {
+		if (!protection->leased || protection->expired)
+			continue;
+		if (protection->expiry <= now) {
+			coreLog(CORE_LOG_WARNING,
+				"Protection lease on [%llu, %llu) expired",
+				(unsigned long long)protection->begin,
+				(unsigned long long)protection->end);
+			protection->expired = true;
+			releaseProtection(protection);
+			std::vector<char>().swap(protection->arena);
+			protection->segments.clear();
+		} else {
+			nextLeaseExpiry =
+				std::min(nextLeaseExpiry, protection->expiry);
+		}
+	}
+}
+
+template<typename T> bool BlockCirclebuf<T>::compress(Protection *protection)
+{
+	if (!std::is_trivially_copyable<T>::value || !compressionAvailable() ||
+	    protection->expired || protection->compressed ||
+	    protection->copyOnWrite)
+		return false;
 
-		if (prev->referencingPtrs)
-			prev->referencingPtrs->prev = currentBCPtr;
-		this->referencingPtrs = currentBCPtr->next;
-		currentBCPtr->next = prev->referencingPtrs;
+	//a protection's runs hold its range in order, so each block becomes
+	//the next segment:
+	std::vector<char> arena;
+	std::vector<typename Protection::Segment> segments;
+	size_t numBytes = 0;
+	for (typename Protection::Run &run : protection->runs) {
+		uint64_t pos = run.pos;
+		Block *block = run.first.block;
+		while (true) {
+			size_t bytes = block->blockLength * sizeof(T);
+			size_t offset = arena.size();
+			arena.resize(offset + compressionBound(bytes));
+			size_t compressedBytes = compressBytes(
+				arena.data() + offset, arena.size() - offset,
+				block->blockStart, bytes,
+				config.compressionLevel);
+			if (compressedBytes == 0)
+				return false;
+			arena.resize(offset + compressedBytes);
+			segments.push_back(
+				{pos, block->blockLength, offset, compressedBytes});
+			pos += block->blockLength;
+			numBytes += bytes;
 
-		prev->referencingPtrs = currentBCPtr;
+			if (block == run.last.block)
+				break;
+			block = block->getNext();
+		}
 	}
+	arena.shrink_to_fit();
 
-	if (prev->referencingPtrs)
-		prev->referencingPtrs->prev = NULL;
+	protection->arena.swap(arena);
+	protection->segments.swap(segments);
+	protection->compressed = true;
+	releaseProtection(protection);
 
-	bfree(this);
+	coreLog(CORE_LOG_INFO,
+		"Compressed protected range [%llu, %llu) with %s: %zu to %zu bytes",
+		(unsigned long long)protection->begin,
+		(unsigned long long)protection->end, compressionCodecName(),
+		numBytes, protection->arena.size());
 	return true;
 }
 
-template<typename T> BlockCirclebuf<T>::BCPtr::BCPtr(Block *block, T *ptr)
+template<typename T>
+size_t BlockCirclebuf<T>::readProtected(Protection *protection, uint64_t pos,
+					T *buffer, size_t count)
 {
-	if (ptr < block->getStartPtr() ||
-	    ptr >= block->getStartPtr() + block->getLength())
-		throw std::out_of_range(
-			"Initialising a BCPtr out of range of the provided block");
+	if (protection->expired || pos < protection->begin ||
+	    pos >= protection->end)
+		return 0;
+	count = std::min(count, (size_t)(protection->end - pos));
 
-	this->block = block;
-	this->ptr = ptr;
-	this->prev = NULL;
-	this->next = block->referencingPtrs;
-	block->referencingPtrs->prev = this;
-	block->referencingPtrs = this;
+	size_t numRead = 0;
+	if (protection->compressed) {
+		std::vector<typename Protection::Segment> &segments =
+			protection->segments;
+		size_t i = std::upper_bound(
+				   segments.begin(), segments.end(), pos,
+				   [](uint64_t pos,
+				      const typename Protection::Segment &segment) {
+					   return pos < segment.pos;
+				   }) -
+			   segments.begin() - 1;
+		while (numRead < count) {
+			const typename Protection::Segment &segment =
+				segments[i];
+			//sequential reads decompress each segment once:
+			if (protection->scratchSegment != i) {
+				protection->scratch.resize(segment.length);
+				protection->scratchSegment = i;
+				if (!decompressBytes(
+					    protection->scratch.data(),
+					    segment.length * sizeof(T),
+					    protection->arena.data() +
+						    segment.offset,
+					    segment.compressedBytes)) {
+					protection->scratchSegment = SIZE_MAX;
+					break;
+				}
+			}
+
+			size_t offset = pos + numRead - segment.pos;
+			size_t numInSegment =
+				std::min(count - numRead, segment.length - offset);
+			Traits::copyOut(buffer + numRead,
+					protection->scratch.data() + offset,
+					numInSegment);
+			numRead += numInSegment;
+			i++;
+		}
+		return numRead;
+	}
+
+	while (numRead < count) {
+		T *ptr;
+		size_t available;
+		if (!locate(protection, pos + numRead, ptr, available))
+			break;
+		size_t numInPiece = std::min(count - numRead, available);
+		Traits::copyOut(buffer + numRead, ptr, numInPiece);
+		numRead += numInPiece;
+	}
+	return numRead;
+}
+
+/*
+ * Finds the element at logical position `pos' of an uncompressed protected
+ * range, either in place or copied aside, and how many follow it
+ * contiguously. Linear in the number of blocks held.
+ */
+template<typename T>
+bool BlockCirclebuf<T>::locate(Protection *protection, uint64_t pos, T *&ptr,
+			       size_t &available)
+{
+	std::vector<typename Protection::Copy> &copies = protection->copies;
+	auto copy = std::upper_bound(
+		copies.begin(), copies.end(), pos,
+		[](uint64_t pos, const typename Protection::Copy &copy) {
+			return pos < copy.pos;
+		});
+	if (copy != copies.begin() &&
+	    pos < (copy - 1)->pos + (copy - 1)->data.size()) {
+		copy--;
+		ptr = copy->data.data() + (pos - copy->pos);
+		available = copy->data.size() - (pos - copy->pos);
+		return true;
+	}
+
+	for (typename Protection::Run &run : protection->runs) {
+		if (pos < run.pos)
+			continue;
+		uint64_t blockPos = run.pos;
+		Block *block = run.first.block;
+		while (true) {
+			if (pos < blockPos + block->blockLength) {
+				ptr = block->blockStart + (pos - blockPos);
+				available = block->blockLength - (pos - blockPos);
+				return true;
+			}
+			blockPos += block->blockLength;
+
+			if (block == run.last.block)
+				break;
+			block = block->getNext();
+		}
+	}
+	return false;
+}
+
+/*
+ * Copies a block the writer is about to overwrite aside to each copy-on-write
+ * snapshot holding it, which then let it go. Only the first
+ * `copyOnWriteChunkBytes' are copied, so the write that got here is never
+ * held up for long; the rest is split off to be copied once the head reaches
+ * it, and the pieces merge back together as the head passes them.
+ */
+template<typename T> void BlockCirclebuf<T>::copyBeforeWrite(Block *block)
+{
+	size_t chunkLength =
+		std::max<size_t>(copyOnWriteChunkBytes / sizeof(T), 1);
+	if (block->blockLength > chunkLength) {
+		block->split(block->blockStart + chunkLength);
+		block->willReconcileNext = true;
+		block->next->willReconcilePrev = true;
+	}
+
+	for (Protection *protection : protections) {
+		if (block->cowCount == 0)
+			break;
+		if (!protection->copyOnWrite)
+			continue;
+
+		std::vector<typename Protection::Run> &runs = protection->runs;
+		for (size_t i = 0; i < runs.size(); i++) {
+			uint64_t pos = runs[i].pos;
+			Block *held = runs[i].first.block;
+			while (held != block && held != runs[i].last.block) {
+				pos += held->blockLength;
+				held = held->getNext();
+			}
+			if (held != block)
+				continue;
+
+			typename Protection::Copy copy = {
+				pos, std::vector<T>(block->blockLength)};
+			Traits::copyOut(copy.data.data(), block->blockStart,
+					block->blockLength);
+			std::vector<typename Protection::Copy> &copies =
+				protection->copies;
+			copies.insert(
+				std::upper_bound(
+					copies.begin(), copies.end(), pos,
+					[](uint64_t pos,
+					   const typename Protection::Copy &copy) {
+						return pos < copy.pos;
+					}),
+				std::move(copy));
+			protection->version++;
+
+			//drop the block from its run, splitting the run if it
+			//was in the middle:
+			Block *prev = block->getPrev();
+			Block *next = block->getNext();
+			if (block == runs[i].first.block &&
+			    block == runs[i].last.block) {
+				runs.erase(runs.begin() + i);
+			} else if (block == runs[i].first.block) {
+				runs[i].first = BCPtr(next, next->getStartPtr());
+				runs[i].pos += block->blockLength;
+			} else if (block == runs[i].last.block) {
+				runs[i].last = BCPtr(prev, prev->getStartPtr() +
+								   prev->getLength());
+			} else {
+				typename Protection::Run after = {
+					pos + block->blockLength,
+					BCPtr(next, next->getStartPtr()),
+					runs[i].last};
+				runs[i].last = BCPtr(prev, prev->getStartPtr() +
+								   prev->getLength());
+				runs.insert(runs.begin() + i + 1, after);
+			}
+			block->cowCount--;
+			break;
+		}
+	}
 }
 
 template<typename T>
-BlockCirclebuf<T>::BCPtr::BCPtr(BCPtr &copy) : BCPtr(copy.block, copy.ptr)
+typename BlockCirclebuf<T>::Snapshot *
+BlockCirclebuf<T>::snapshot(const BCPtr &begin, const BCPtr &end,
+			    bool copyOnWrite)
 {
+	//in concurrent mode the writer must not touch what the reader sees:
+	Protection *protection =
+		hold(begin, end, copyOnWrite && !config.concurrent);
+	Snapshot *snapshot = new Snapshot(this, protection);
+	snapshots.push_back(snapshot);
+	return snapshot;
 }
 
-template<typename T> BlockCirclebuf<T>::BCPtr::~BCPtr()
+template<typename T>
+void BlockCirclebuf<T>::releaseSnapshot(Snapshot *snapshot)
 {
-	if (prev)
-		prev->next = next;
-	if (next)
-		next->prev = prev;
-	if (block->referencingPtrs == this)
-		block->referencingPtrs = next;
+	dropProtection(snapshot->protection);
+	snapshots.erase(std::remove(snapshots.begin(), snapshots.end(),
+				    snapshot),
+			snapshots.end());
+	delete snapshot;
 }
 
+/*
+ * Blocks between two BCPtrs that sit on block boundaries. Each BCPtr is at the
+ * start of its block unless it rests at the end of one.
+ */
 template<typename T>
-typename BlockCirclebuf<T>::BCPtr &
-BlockCirclebuf<T>::BCPtr::operator=(const BCPtr &other)
+void BlockCirclebuf<T>::blocksInRange(BCPtr &begin, BCPtr &end,
+				      std::vector<Block *> &blocks)
 {
-	if (other.block != this->block) {
-		if (prev)
-			prev->next = next;
-		if (next)
-			next->prev = prev;
-		if (block->referencingPtrs == this)
-			block->referencingPtrs = next;
+	Block *block = begin.ptr == begin.block->getStartPtr()
+			       ? begin.block
+			       : begin.block->getNext();
+	Block *endBlock = end.ptr == end.block->getStartPtr()
+				  ? end.block
+				  : end.block->getNext();
 
-		this->prev = NULL;
-		this->next = block->referencingPtrs;
-		if (other.block->referencingPtrs)
-			other.block->referencingPtrs->prev = this;
-		other.block->referencingPtrs = this;
-		this->block = other.block;
+	//a full buffer's range starts and ends in the same place, so is only
+	//told apart from an empty one by position:
+	if (begin.pos == end.pos)
+		return;
+	do {
+		blocks.push_back(block);
+		block = block->getNext();
+	} while (block != endBlock);
+}
+
+template<typename T>
+typename BlockCirclebuf<T>::BCPtr BlockCirclebuf<T>::ptrAt(uint64_t pos)
+{
+	if (pos < tail.pos || pos > head.pos)
+		throw std::out_of_range(
+			"Tried to locate a BlockCirclebuf position outside the live stream");
+
+	if (pos == head.pos) {
+		head.normalise();
+		return head;
 	}
 
-	this->ptr = other->ptr;
+	tail.normalise();
+	BCPtr cursor = tail;
+	advanceCursor(cursor, pos - tail.pos);
+	//a concurrent tail may rest at the end of a block the head has since
+	//come back round to, so go on to where `pos' actually is:
+	if (cursor.ptr ==
+	    cursor.block->getStartPtr() + cursor.block->getLength())
+		moveToNextBlock(cursor);
+	return cursor;
+}
 
-	return *this;
+template<typename T>
+size_t BlockCirclebuf<T>::writev(const std::vector<Span> &records,
+				 std::vector<uint64_t> &positions)
+{
+	std::vector<Span> &spans = writeSpans;
+	size_t numRemaining = 0;
+	size_t numRecords = records.size();
+	for (const Span &record : records)
+		numRemaining += record.length;
+
+	//as in write(), turn away records that could never fit before
+	//evicting anything for them, leaving the batch up to the first:
+	if (config.overflowPolicy == OverflowPolicy::REJECT) {
+		if (!config.concurrent)
+			expireLeases();
+		size_t writable = writableCapacity();
+		numRemaining = 0;
+		numRecords = 0;
+		while (numRecords < records.size() &&
+		       numRemaining + records[numRecords].length <= writable)
+			numRemaining += records[numRecords++].length;
+	}
+
+	positions.clear();
+	size_t recordIndex = 0;
+	size_t recordOffset = 0;
+	uint64_t pos = head.pos;
+	while (true) {
+		//empty records start (and end) wherever the head is:
+		while (recordIndex < numRecords &&
+		       recordOffset == records[recordIndex].length) {
+			if (recordOffset == 0)
+				positions.push_back(pos);
+			recordIndex++;
+			recordOffset = 0;
+		}
+		if (recordIndex == numRecords)
+			break;
+
+		size_t numReserved = reserve(spans, numRemaining);
+		bool rejected = numReserved < numRemaining &&
+				config.overflowPolicy == OverflowPolicy::REJECT;
+		if (rejected) {
+			//only the records that fit whole are written, and the
+			//rest are not retried over them:
+			size_t numWhole = 0;
+			for (size_t i = recordIndex;
+			     i < numRecords &&
+			     numWhole + records[i].length <= numReserved;
+			     i++)
+				numWhole += records[i].length;
+			numReserved = numWhole;
+			truncateSpans(spans, numReserved);
+		}
+		if (numReserved == 0)
+			break;
+
+		for (Span &span : spans) {
+			size_t spanOffset = 0;
+			while (spanOffset < span.length) {
+				const Span &record = records[recordIndex];
+				if (recordOffset == 0)
+					positions.push_back(pos);
+
+				size_t numCopied = std::min(
+					record.length - recordOffset,
+					span.length - spanOffset);
+				if (numCopied > 0)
+					Traits::copyIn(span.ptr + spanOffset,
+						       record.ptr + recordOffset,
+						       numCopied);
+				spanOffset += numCopied;
+				recordOffset += numCopied;
+				pos += numCopied;
+
+				if (recordOffset == record.length) {
+					recordIndex++;
+					recordOffset = 0;
+				}
+			}
+		}
+
+		commit(numReserved);
+		numRemaining -= numReserved;
+		if (rejected)
+			break;
+	}
+
+	//a record cut short by DROP is not one to index:
+	positions.resize(recordIndex);
+	return recordIndex;
+}
+
+/*
+ * Most elements the buffer could hold unprotected, counting any growth still
+ * allowed.
+ */
+template<typename T> size_t BlockCirclebuf<T>::writableCapacity()
+{
+	size_t limit = capacity;
+	if (config.growthSize > 0)
+		limit = std::max(limit, config.maxSize);
+	return limit - protectedLength;
 }
 
+/*
+ * Shortens `spans' to cover only their first `count' elements.
+ */
 template<typename T>
-BlockCirclebuf<T>::SuperblockAllocation::SuperblockAllocation(T *allocationStart)
+void BlockCirclebuf<T>::truncateSpans(std::vector<Span> &spans, size_t count)
+{
+	for (size_t i = 0; i < spans.size(); i++) {
+		if (spans[i].length >= count) {
+			spans[i].length = count;
+			spans.resize(count > 0 ? i + 1 : i);
+			return;
+		}
+		count -= spans[i].length;
+	}
+}
+
+template<typename T>
+template<typename Count>
+void BlockCirclebuf<T>::addRelaxed(std::atomic<Count> &counter, uint64_t delta)
+{
+	counter.store(counter.load(std::memory_order_relaxed) + (Count)delta,
+		      std::memory_order_relaxed);
+}
+
+template<typename T>
+template<typename Count>
+void BlockCirclebuf<T>::subtractRelaxed(std::atomic<Count> &counter,
+					uint64_t delta)
+{
+	counter.store(counter.load(std::memory_order_relaxed) - (Count)delta,
+		      std::memory_order_relaxed);
+}
+
+/*
+ * Publishes the protected total after protection or growth changed the
+ * layout, leaving the largest free span, which takes a walk of the ring, to
+ * be worked out by the next stats() that asks for it.
+ */
+template<typename T> void BlockCirclebuf<T>::layoutChanged()
+{
+	writerCounters.protectedLength.store(protectedLength,
+					     std::memory_order_relaxed);
+	writerCounters.layoutChanged.store(true, std::memory_order_relaxed);
+}
+
+/*
+ * Recomputes the largest free span, walking the ring once.
+ */
+template<typename T> void BlockCirclebuf<T>::updateLayoutStats()
+{
+	//start counting just after a protected block, if there is one, so
+	//the run that wraps round is counted whole:
+	Block *start = head.block;
+	Block *block = start;
+	do {
+		if (block->protectCount > 0) {
+			start = block;
+			break;
+		}
+		block = block->next;
+	} while (block != start);
+
+	size_t largest = 0;
+	size_t run = 0;
+	block = start;
+	do {
+		block = block->next;
+		if (block->protectCount > 0) {
+			run = 0;
+		} else {
+			run += block->blockLength;
+			largest = std::max(largest, run);
+		}
+	} while (block != start);
+
+	writerCounters.largestFreeSpan.store(largest,
+					     std::memory_order_relaxed);
+}
+
+template<typename T>
+size_t BlockCirclebuf<T>::reserve(std::vector<Span> &spans, size_t count)
+{
+	size_t numReserved = 0;
+	head.normalise();
+	spans.clear();
+	reservations.clear();
+
+	//expired leases give their capacity back before the buffer grows to
+	//make up for it. In concurrent mode that is up to the export side.
+	if (!config.concurrent)
+		expireLeases();
+
+	//shrink back once growth is no longer needed:
+	if (!config.concurrent && capacity > baseCapacity &&
+	    head.ptr == head.block->getStartPtr())
+		reclaimIdle(head.pos, spans);
+
+	//splice in fresh space at the head once protection leaves too little:
+	if (capacity - protectedLength < config.growthThreshold) {
+		Block *grown = grow(head.block, head.ptr);
+		if (grown) {
+			head.moveTo(grown, grown->getStartPtr());
+			if (!config.concurrent && tail.pos == head.pos)
+				tail = head;
+		}
+	}
+
+	//the rest of a protected head block holds the oldest data in the
+	//buffer, so is excluded like any other protected block passed. The
+	//head waits behind it rather than in it:
+	if (!config.concurrent && head.block->protectCount > 0 &&
+	    head.ptr != head.block->getStartPtr() + head.block->getLength()) {
+		head.block->split(head);
+		restHeadBehind();
+	}
+
+	//a block is only checked for unread data as the head enters it, so
+	//also bound a concurrent reservation by the space the reader has freed:
+	if (config.concurrent) {
+		uint64_t unread = head.pos - publishedTailPos.load(
+						     std::memory_order_acquire);
+		count = std::min(count, unread < capacity
+						? (size_t)(capacity - unread)
+						: (size_t)0);
+	}
+
+	Block *block = head.block;
+	T *ptr = head.ptr;
+
+	//a head resting at the end of the block it filled goes on from the
+	//next one the writer may use:
+	if (ptr == block->getStartPtr() + block->getLength()) {
+		block = nextWritableOrGrow(block);
+		if (!block)
+			return 0;
+		ptr = block->getStartPtr();
+	}
+
+	if (ptr == block->getStartPtr() && !canOverwrite(block))
+		return 0;
+	if (block->cowCount > 0 && block->protectCount == 0 &&
+	    ptr < block->getStartPtr() + block->getLength())
+		copyBeforeWrite(block);
+	if (block->protectCount > 0) {
+		block = nextWritableOrGrow(block);
+		if (!block)
+			return 0;
+		ptr = block->getStartPtr();
+	}
+	//whatever the head writes next is part of the live stream (left to
+	//nextWritableBlock() in concurrent mode, as the reader walks these):
+	if (!config.concurrent)
+		block->readProtect = false;
+
+	Block *firstBlock = block;
+	T *firstPtr = ptr;
+	bool lapped = false;
+	bool limited = false;
+	bool overran = false;
+	uint64_t limit = evictionLimit();
+	while (numReserved < count && !limited) {
+		//never wrap round onto elements already reserved by this call:
+		T *blockEnd = lapped ? firstPtr
+				     : block->getStartPtr() + block->getLength();
+		size_t numInCurrentBlock =
+			std::min(count - numReserved, (size_t)(blockEnd - ptr));
+
+		//evict any unread data about to be overwritten. The buffer is
+		//only empty (not full) when tail and head are logically equal.
+		if (!config.concurrent && tail.pos < head.pos &&
+		    tail.block == block &&
+		    tail.ptr >= ptr && tail.ptr < ptr + numInCurrentBlock) {
+			size_t numEvicted = ptr + numInCurrentBlock - tail.ptr;
+
+			//stop short of data a retaining reader has yet to read:
+			if (tail.pos + numEvicted > limit) {
+				size_t excess = tail.pos + numEvicted - limit;
+				numEvicted -= excess;
+				numInCurrentBlock -= excess;
+				limited = true;
+			}
+
+			advanceCursor(tail, numEvicted);
+			if (tail.pos == head.pos)
+				tail = head;
+			addRelaxed(writerCounters.evicted, numEvicted);
+			overran = overran || numEvicted > 0;
+		}
+
+		if (numInCurrentBlock > 0) {
+			spans.push_back({ptr, numInCurrentBlock});
+			reservations.push_back({block, ptr, numInCurrentBlock});
+		}
+		numReserved += numInCurrentBlock;
+		if (numReserved == count || lapped || limited)
+			break;
+
+		//a grown superblock ahead may have just left the retention
+		//window; drop it rather than overwrite it:
+		if (!config.concurrent && capacity > baseCapacity)
+			reclaimIdle(head.pos + numReserved, spans);
+
+		block = nextWritableOrGrow(block);
+		if (!block)
+			break;
+		ptr = block->getStartPtr();
+		lapped = block == firstBlock;
+
+		//the start of the block the head was already in holds what it
+		//wrote last time round, which the reader may not have reached:
+		if (lapped && config.concurrent)
+			break;
+	}
+
+	if (overran)
+		addRelaxed(writerCounters.tailOverruns, 1);
+	syncReaders();
+	return numReserved;
+}
+
+/*
+ * Publishes `count' elements previously handed out by reserve(), moving the
+ * head along exactly the blocks it reserved. A block that fills up leaves
+ * the head resting at its end until the next reserve() picks where to go.
+ */
+template<typename T> void BlockCirclebuf<T>::commit(size_t count)
+{
+	addRelaxed(writerCounters.written, count);
+	head.normalise();
+
+	for (const Reservation &reservation : reservations) {
+		if (count == 0)
+			break;
+
+		//a reserved block merged into the head's on the way in just
+		//carries on from where the head is:
+		bool atBlockEnd = head.ptr == head.block->getStartPtr() +
+						      head.block->getLength();
+		if (head.ptr != reservation.ptr ||
+		    (atBlockEnd && head.block != reservation.block))
+			moveHead(reservation.block, reservation.ptr);
+
+		//published with the head below:
+		if (head.ptr == head.block->getStartPtr())
+			head.block->firstWritePos.store(
+				head.pos, std::memory_order_relaxed);
+
+		size_t numInCurrentBlock = std::min(count, reservation.length);
+		head.ptr += numInCurrentBlock;
+		head.pos += numInCurrentBlock;
+		head.block->lastWritePos = head.pos;
+		count -= numInCurrentBlock;
+	}
+	reservations.clear();
+
+	if (!config.concurrent) {
+		//an empty buffer keeps its tail at the head:
+		if (tail.pos == head.pos)
+			tail = head;
+		syncReaders();
+	}
+
+	publishedHeadPos.store(head.pos, std::memory_order_release);
+}
+
+template<typename T> size_t BlockCirclebuf<T>::reclaim()
+{
+	head.normalise();
+	size_t numReleased = reclaimIdle(head.pos, std::vector<Span>());
+
+	//the memory the writer let go of or used up is freed and replaced
+	//here, away from its path:
+	for (SuperblockAllocation *superblock : retiredSuperblocks)
+		freeSuperblock(superblock);
+	retiredSuperblocks.clear();
+	prepareGrowth();
+
+	if (capacity != loggedCapacity) {
+		coreLog(CORE_LOG_INFO,
+			"Replay buffer resized from %zu to %zu elements (%zu protected)",
+			loggedCapacity, capacity, protectedLength);
+		loggedCapacity = capacity;
+	}
+	return numReleased;
+}
+
+/*
+ * Sets aside the superblock the next growth will splice in, if growth could
+ * still use one, so that grow() need not allocate it on the writer's path.
+ */
+template<typename T> void BlockCirclebuf<T>::prepareGrowth()
+{
+	if (config.growthSize == 0 || spareSuperblock ||
+	    capacity + config.growthSize > config.maxSize)
+		return;
+	spareSuperblock = newSuperblockAllocation(config.growthSize);
+}
+
+/*
+ * reclaim() for a head about to reach `writePos', with `reserved' already
+ * handed out by reserve() and so not to be released.
+ */
+template<typename T>
+size_t BlockCirclebuf<T>::reclaimIdle(uint64_t writePos,
+				      const std::vector<Span> &reserved)
+{
+	size_t numReleased = 0;
+
+	//data further behind the head than the original buffer size is outside
+	//the retention window, and would otherwise keep grown superblocks live.
+	//In concurrent mode the tail is the reader's, and unread data is never
+	//dropped, so such superblocks wait until it has been read:
+	tail.normalise();
+	uint64_t windowStart = writePos > baseCapacity ? writePos - baseCapacity
+						      : 0;
+	windowStart = std::min(windowStart, std::min(head.pos, evictionLimit()));
+	if (!config.concurrent && windowStart > tail.pos) {
+		addRelaxed(writerCounters.evicted, windowStart - tail.pos);
+		advanceCursor(tail, windowStart - tail.pos);
+		if (tail.pos == head.pos)
+			tail = head;
+		syncReaders();
+		publishedTailPos.store(tail.pos, std::memory_order_release);
+	}
+
+	//newest first, as those are the ones grown on demand:
+	for (size_t i = superblockAllocations.size(); i > 0; i--) {
+		SuperblockAllocation *superblock = superblockAllocations[i - 1];
+		size_t remaining = capacity - superblock->allocationLength;
+
+		//don't release what growth would immediately ask for again:
+		if (remaining < baseCapacity ||
+		    remaining - protectedLength <= config.growthThreshold ||
+		    !isIdle(superblock, reserved))
+			continue;
+
+		numReleased += superblock->allocationLength;
+		releaseSuperblock(superblock);
+	}
+
+	return numReleased;
+}
+
+/*
+ * Whether `superblock' can be dropped without losing anything: none of its
+ * blocks are protected, reserved or hold data the tail has not yet passed,
+ * and the only BCPtrs into it are logically at the head, which may be waiting
+ * at the start of one of its blocks having written nothing there yet.
+ */
+template<typename T>
+bool BlockCirclebuf<T>::isIdle(SuperblockAllocation *superblock,
+			       const std::vector<Span> &reserved)
+{
+	if (head.block->parentSuperblock == superblock &&
+	    head.ptr != head.block->getStartPtr())
+		return false;
+	if (tail.block->parentSuperblock == superblock && tail.pos != head.pos)
+		return false;
+
+	for (const Span &span : reserved)
+		if (span.ptr >= superblock->allocationStart &&
+		    span.ptr < superblock->allocationStart +
+				       superblock->allocationLength)
+			return false;
+
+	Block *block = head.block;
+	do {
+		if (block->parentSuperblock == superblock) {
+			if (block->protectCount > 0 || block->cowCount > 0 ||
+			    block->lastWritePos > tail.pos)
+				return false;
+			for (BCPtr *ptr = block->referencingPtrs; ptr;
+			     ptr = ptr->next)
+				if (ptr->pos != head.pos)
+					return false;
+		}
+		block = block->getNext();
+	} while (block != head.block);
+
+	return true;
+}
+
+/*
+ * Unlinks every block of an idle superblock from the ring. Its memory is
+ * kept as the spare for the next growth if it fits, and otherwise left for
+ * reclaim() to return to the system. BCPtrs left in it are all logically at
+ * the head, so follow it; if the head itself was in the superblock it waits at
+ * the end of the block before until its next write.
+ */
+template<typename T>
+void BlockCirclebuf<T>::releaseSuperblock(SuperblockAllocation *superblock)
+{
+	Block *restingBlock = head.block;
+	T *restingPtr = head.ptr;
+	if (restingBlock->parentSuperblock == superblock) {
+		while (restingBlock->parentSuperblock == superblock)
+			restingBlock = restingBlock->getPrev();
+		restingPtr = restingBlock->getStartPtr() +
+			     restingBlock->getLength();
+	}
+
+	Block *block = restingBlock->getNext();
+	while (block != restingBlock) {
+		Block *nextBlock = block->getNext();
+		if (block->parentSuperblock == superblock) {
+			while (block->referencingPtrs)
+				block->referencingPtrs->moveTo(restingBlock,
+							       restingPtr);
+			block->prev->next = nextBlock;
+			nextBlock->prev = block->prev;
+			blockPool.release(block);
+			subtractRelaxed(writerCounters.blockCount, 1);
+		}
+		block = nextBlock;
+	}
+
+	//detached BCPtrs are not in the lists above:
+	if (head.block->parentSuperblock == superblock)
+		head.moveTo(restingBlock, restingPtr);
+	if (tail.block->parentSuperblock == superblock)
+		tail.moveTo(restingBlock, restingPtr);
+
+	capacity -= superblock->allocationLength;
+	layoutChanged();
+	superblockAllocations.erase(std::remove(superblockAllocations.begin(),
+						superblockAllocations.end(),
+						superblock),
+				    superblockAllocations.end());
+
+	if (!spareSuperblock &&
+	    superblock->allocationLength == config.growthSize)
+		spareSuperblock = superblock;
+	else
+		retiredSuperblocks.push_back(superblock);
+}
+
+/*
+ * Whether the writer may start overwriting `block'. Outside concurrent mode
+ * unread data is simply evicted; in concurrent mode the reader must first have
+ * consumed everything previously written to the block.
+ */
+template<typename T> bool BlockCirclebuf<T>::canOverwrite(Block *block)
+{
+	return !config.concurrent ||
+	       block->lastWritePos <=
+		       publishedTailPos.load(std::memory_order_acquire);
+}
+
+/*
+ * Logical position the tail may not be evicted past, set by the slowest
+ * retaining reader.
+ */
+template<typename T> uint64_t BlockCirclebuf<T>::evictionLimit()
+{
+	uint64_t limit = UINT64_MAX;
+	for (Reader *reader : readers)
+		if (reader->policy == ReaderPolicy::RETAIN)
+			limit = std::min(limit, reader->cursor.pos);
+	return limit;
+}
+
+/*
+ * Returns the next block after `block' that the head may write to, or NULL if
+ * there is none. Any write-protected blocks passed over are excluded from the
+ * live stream (read-protected); if the tail is in one of them its remaining
+ * data is dropped, so that excluded blocks never hold data counted between
+ * tail and head.
+ */
+template<typename T>
+typename BlockCirclebuf<T>::Block *
+BlockCirclebuf<T>::nextWritableBlock(Block *block)
+{
+	Block *startBlock = block;
+	do {
+		block = block->getNext();
+		if (!canOverwrite(block))
+			return NULL;
+		if (!config.concurrent && block->protectCount > 0 &&
+		    tail.block == block && tail.pos < head.pos) {
+			size_t numDropped = block->getLength() -
+					    (tail.ptr - block->getStartPtr());
+			if (tail.pos + numDropped > evictionLimit())
+				return NULL;
+			advanceCursor(tail, numDropped);
+			addRelaxed(writerCounters.evicted, numDropped);
+			if (tail.pos == head.pos)
+				tail = head;
+			syncReaders();
+		}
+
+		if (block->cowCount > 0 && block->protectCount == 0)
+			copyBeforeWrite(block);
+		if (block->protectCount > 0)
+			addRelaxed(writerCounters.blocksSkipped, 1);
+
+		block->readProtect = block->protectCount > 0;
+	} while (block->protectCount > 0 && block != startBlock);
+
+	return block->protectCount > 0 ? NULL : block;
+}
+
+/*
+ * As nextWritableBlock(), but grows the buffer after `block' rather than
+ * leaving the writer with nowhere to go.
+ */
+template<typename T>
+typename BlockCirclebuf<T>::Block *
+BlockCirclebuf<T>::nextWritableOrGrow(Block *block)
+{
+	Block *nextBlock = nextWritableBlock(block);
+	if (!nextBlock)
+		nextBlock = grow(block,
+				 block->getStartPtr() + block->getLength());
+	return nextBlock;
+}
+
+/*
+ * Splices a new superblock of `config.growthSize' elements into the ring at
+ * `ptr' within `block', splitting it if need be. `ptr' must be the head or
+ * lie just ahead of it, so that the new space is the next to be written and
+ * never holds elements counted between tail and head. The spare superblock
+ * set aside by prepareGrowth() is used if there is one. Returns the new block,
+ * or NULL if growth is disabled or would exceed `config.maxSize'.
+ */
+template<typename T>
+typename BlockCirclebuf<T>::Block *BlockCirclebuf<T>::grow(Block *block,
+							   T *ptr)
+{
+	if (config.growthSize == 0 ||
+	    capacity + config.growthSize > config.maxSize)
+		return NULL;
+
+	Block *prev = block;
+	Block *next = block->getNext();
+	if (ptr == block->getStartPtr() + block->getLength()) {
+		//splice after the block
+	} else if (config.concurrent) {
+		//splicing anywhere else may change what the reader walks over
+		return NULL;
+	} else if (ptr == block->getStartPtr()) {
+		prev = block->getPrev();
+		next = block;
+	} else {
+		block->split(ptr);
+		next = block->getNext();
+	}
+
+	Block *newBlock = allocateSuperblock(config.growthSize, prev, next);
+	layoutChanged();
+	return newBlock;
+}
+
+/*
+ * Moves the head into a block reserve() picked for it, taking any cursors
+ * caught up with it along and carrying out any reconciliation deferred until
+ * the head passed.
+ */
+template<typename T> void BlockCirclebuf<T>::moveHead(Block *block, T *ptr)
+{
+	//cursors caught up with the head wait for its next element there:
+	if (!config.concurrent) {
+		if (tail.pos == head.pos)
+			tail.moveTo(block, ptr);
+		for (Reader *reader : readers)
+			if (reader->cursor.pos == head.pos)
+				reader->cursor.moveTo(block, ptr);
+	}
+	head.moveTo(block, ptr);
+
+	if (config.statsLogInterval >
+		    std::chrono::steady_clock::duration::zero() &&
+	    std::chrono::steady_clock::now() >= nextStatsLog) {
+		logStats();
+		nextStatsLog = std::chrono::steady_clock::now() +
+			       config.statsLogInterval;
+	}
+
+	if (config.concurrent)
+		return;
+
+	if (config.deferReconcile) {
+		//leave the list surgery to coalesce():
+		if (head.block->willReconcilePrev ||
+		    head.block->willReconcileNext)
+			reconcilePending = true;
+	} else {
+		if (head.block->willReconcilePrev)
+			head.block->attemptReconcilePrev();
+
+		if (head.block->willReconcileNext)
+			head.block->attemptReconcileNext();
+	}
+}
+
+/*
+ * Moves the head from the start of its block to the end of the one before,
+ * along with the tail of an empty buffer and any readers caught up with it,
+ * so that none of them rests in a block about to be excluded from the live
+ * stream.
+ */
+template<typename T> void BlockCirclebuf<T>::restHeadBehind()
+{
+	if (head.ptr != head.block->getStartPtr())
+		return;
+
+	Block *block = head.block->getPrev();
+	T *ptr = block->getStartPtr() + block->getLength();
+	if (tail.pos == head.pos)
+		tail.moveTo(block, ptr);
+	for (Reader *reader : readers)
+		if (reader->cursor.pos == head.pos)
+			reader->cursor.moveTo(block, ptr);
+	head.moveTo(block, ptr);
+}
+
+/*
+ * Moves a cursor forward by `count' elements of the live stream, skipping
+ * over read-protected blocks. In concurrent mode the tail only moves into the
+ * next block once there is data there to read, as the writer may still be
+ * deciding which block that is.
+ */
+template<typename T>
+void BlockCirclebuf<T>::advanceCursor(BCPtr &cursor, size_t count)
+{
+	while (count > 0) {
+		if (cursor.ptr >=
+		    cursor.block->getStartPtr() + cursor.block->getLength())
+			moveToNextBlock(cursor);
+
+		size_t numInCurrentBlock = std::min(
+			count,
+			cursor.block->getLength() -
+				(cursor.ptr - cursor.block->getStartPtr()));
+		cursor.ptr += numInCurrentBlock;
+		cursor.pos += numInCurrentBlock;
+		count -= numInCurrentBlock;
+	}
+
+	if (!config.concurrent &&
+	    cursor.ptr >=
+		    cursor.block->getStartPtr() + cursor.block->getLength())
+		moveToNextBlock(cursor);
+}
+
+template<typename T> void BlockCirclebuf<T>::moveToNextBlock(BCPtr &cursor)
+{
+	Block *nextBlock = cursor.block;
+	do {
+		nextBlock = nextBlock->getNext();
+	} while (!continuesIn(nextBlock, cursor.pos) &&
+		 (config.concurrent || nextBlock != head.block));
+	cursor.moveTo(nextBlock, nextBlock->getStartPtr());
+}
+
+/*
+ * Whether the live stream carries on from logical position `pos' at the start
+ * of `block', for a cursor that has reached the end of a block before it. In
+ * concurrent mode excluded blocks are not enough to go by, as the reader may
+ * have been resting at a block end while the writer grew the buffer there or
+ * came back round to blocks it excluded, so it looks for the block the head
+ * entered at `pos'.
+ */
+template<typename T>
+bool BlockCirclebuf<T>::continuesIn(Block *block, uint64_t pos)
+{
+	if (config.concurrent)
+		return block->firstWritePos.load(std::memory_order_relaxed) ==
+		       pos;
+	return !block->readProtect;
+}
+
+/*
+ * Keeps reader cursors between tail and head: readers overtaken by eviction
+ * are dragged along with the tail, and readers that have caught up follow
+ * the head so they never wait in a block the head has since skipped.
+ */
+template<typename T> void BlockCirclebuf<T>::syncReaders()
+{
+	for (Reader *reader : readers) {
+		if (reader->cursor.pos < tail.pos) {
+			reader->overrun += tail.pos - reader->cursor.pos;
+			reader->cursor = tail;
+		}
+		if (reader->cursor.pos == head.pos)
+			reader->cursor = head;
+	}
+}
+
+template<typename T>
+size_t BlockCirclebuf<T>::peekFrom(BCPtr &cursor, size_t available,
+				   std::vector<Span> &spans, size_t count)
+{
+	size_t remaining = std::min(count, available);
+	size_t numPeeked = 0;
+	Block *block = cursor.block;
+	T *ptr = cursor.ptr;
+
+	spans.clear();
+	while (remaining > 0) {
+		size_t numInCurrentBlock =
+			std::min(remaining, block->getLength() -
+						    (ptr - block->getStartPtr()));
+		if (numInCurrentBlock > 0) {
+			spans.push_back({ptr, numInCurrentBlock});
+			remaining -= numInCurrentBlock;
+			numPeeked += numInCurrentBlock;
+		}
+		if (remaining == 0)
+			break;
+
+		//a lap with every block excluded leaves nothing more to read:
+		Block *lapStart = block;
+		uint64_t pos = cursor.pos + numPeeked;
+		do {
+			block = block->getNext();
+		} while (!continuesIn(block, pos) && block != lapStart);
+		if (!continuesIn(block, pos))
+			break;
+		ptr = block->getStartPtr();
+	}
+
+	return numPeeked;
+}
+
+template<typename T>
+size_t BlockCirclebuf<T>::peek(std::vector<Span> &spans, size_t count)
+{
+	tail.normalise();
+	return peekFrom(tail, readable(), spans, count);
+}
+
+template<typename T> void BlockCirclebuf<T>::advance(size_t count)
+{
+	tail.normalise();
+	count = std::min(count, readable());
+	advanceCursor(tail, count);
+	addRelaxed(readerCounters.read, count);
+	if (!config.concurrent && tail.pos == head.pos)
+		tail = head;
+	syncReaders();
+
+	publishedTailPos.store(tail.pos, std::memory_order_release);
+}
+
+template<typename T>
+typename BlockCirclebuf<T>::Reader *
+BlockCirclebuf<T>::addReader(ReaderPolicy policy)
+{
+	if (config.concurrent)
+		throw std::runtime_error(
+			"BlockCirclebuf readers are not supported in concurrent mode");
+
+	Reader *reader = new Reader(tail, policy);
+	readers.push_back(reader);
+	return reader;
+}
+
+template<typename T> void BlockCirclebuf<T>::removeReader(Reader *reader)
+{
+	readers.erase(std::remove(readers.begin(), readers.end(), reader),
+		      readers.end());
+	delete reader;
+}
+
+/*
+ * Number of elements written that `reader' has not yet read.
+ */
+template<typename T> size_t BlockCirclebuf<T>::readerLag(Reader *reader)
+{
+	return ptrDifference(reader->cursor, head);
+}
+
+template<typename T>
+size_t BlockCirclebuf<T>::peek(Reader *reader, std::vector<Span> &spans,
+			       size_t count)
+{
+	return peekFrom(reader->cursor, readerLag(reader), spans, count);
+}
+
+template<typename T>
+void BlockCirclebuf<T>::advance(Reader *reader, size_t count)
+{
+	count = std::min(count, readerLag(reader));
+	advanceCursor(reader->cursor, count);
+	addRelaxed(readerCounters.read, count);
+	syncReaders();
+}
+
+template<typename T>
+size_t BlockCirclebuf<T>::read(Reader *reader, T *buffer, size_t count)
+{
+	std::vector<Span> &spans = readSpans;
+	size_t numRead = peek(reader, spans, count);
+
+	T *out = buffer;
+	for (Span &span : spans) {
+		Traits::copyOut(out, span.ptr, span.length);
+		out += span.length;
+	}
+
+	advance(reader, numRead);
+	return numRead;
+}
+
+template<typename T> size_t BlockCirclebuf<T>::read(T *buffer, size_t count)
+{
+	std::vector<Span> &spans = readSpans;
+	size_t numRead = peek(spans, count);
+
+	T *out = buffer;
+	for (Span &span : spans) {
+		Traits::copyOut(out, span.ptr, span.length);
+		out += span.length;
+	}
+
+	advance(numRead);
+	return numRead;
+}
+
+template<typename T> bool BlockCirclebuf<T>::Block::attemptReconcileNext()
+{
+	return next->attemptReconcilePrev();
+}
+
+template<typename T> bool BlockCirclebuf<T>::Block::attemptReconcilePrev()
+{
+	//fail if reconciling with self
+	if (prev == this)
+		return false;
+
+	//fail if not in same superblock
+	if (prev->parentSuperblock != this->parentSuperblock)
+		return false;
+
+	//fail if not physically adjacent
+	if (prev->blockStart + prev->blockLength != this->blockStart)
+		return false;
+
+	//defer until read protection ends if either is read protected.
+	//(avoid merging in corrupted data/excluding good data)
+	if (this->readProtect || prev->readProtect) {
+		this->willReconcilePrev = true;
+		prev->willReconcileNext = true;
+		return false;
+	}
+
+	//fail if either is write protected: protected blocks keep their
+	//boundaries until released, and merge with their neighbours then
+	if (this->protectCount > 0 || prev->protectCount > 0 ||
+	    this->cowCount > 0 || prev->cowCount > 0)
+		return false;
+
+	//perform reconciliation:
+	prev->blockLength = prev->blockLength + this->blockLength;
+	prev->next = this->next;
+	this->next->prev = prev;
+	prev->willReconcileNext = this->willReconcileNext;
+	prev->lastWritePos = std::max(prev->lastWritePos, this->lastWritePos);
+
+	//update all BCPtrs to point to newly reconciled block.
+	while (this->referencingPtrs)
+		this->referencingPtrs->moveTo(prev,
+					      this->referencingPtrs->ptr);
+
+	BlockCirclebuf *owner = parentSuperblock->owner;
+	owner->blockPool.release(this);
+	subtractRelaxed(owner->writerCounters.blockCount, 1);
+	addRelaxed(owner->writerCounters.reconciles, 1);
+	return true;
+}
+
+template<typename T> BlockCirclebuf<T>::BCPtr::BCPtr()
+{
+	this->block = NULL;
+	this->ptr = NULL;
+	this->pos = 0;
+	this->prev = NULL;
+	this->next = NULL;
+	this->detached = false;
+}
+
+template<typename T>
+BlockCirclebuf<T>::BCPtr::BCPtr(Block *block, T *ptr, uint64_t pos)
+{
+	//may rest at the end of the block, as the head and tail can:
+	if (ptr < block->getStartPtr() ||
+	    ptr > block->getStartPtr() + block->getLength())
+		throw std::out_of_range(
+			"Initialising a BCPtr out of range of the provided block");
+
+	this->block = NULL;
+	this->pos = pos;
+	this->prev = NULL;
+	this->next = NULL;
+	this->detached = false;
+	moveTo(block, ptr);
+}
+
+template<typename T>
+BlockCirclebuf<T>::BCPtr::BCPtr(const BCPtr &copy) : BCPtr()
+{
+	//copies may rest at the end of a block, as the head and tail can:
+	*this = copy;
+}
+
+template<typename T> BlockCirclebuf<T>::BCPtr::~BCPtr()
+{
+	moveTo(NULL, NULL);
+}
+
+template<typename T>
+typename BlockCirclebuf<T>::BCPtr &
+BlockCirclebuf<T>::BCPtr::operator=(const BCPtr &other)
+{
+	moveTo(other.block, other.ptr);
+	this->pos = other.pos;
+
+	return *this;
+}
+
+/*
+ * Re-points this BCPtr, keeping the referencingPtrs lists of the old and new
+ * blocks up to date. The logical position is left for the caller to maintain.
+ */
+template<typename T>
+void BlockCirclebuf<T>::BCPtr::moveTo(Block *block, T *ptr)
+{
+	if (block != this->block && !detached) {
+		if (prev)
+			prev->next = next;
+		if (next)
+			next->prev = prev;
+		if (this->block && this->block->referencingPtrs == this)
+			this->block->referencingPtrs = next;
+
+		this->prev = NULL;
+		this->next = NULL;
+		if (block) {
+			this->next = block->referencingPtrs;
+			if (block->referencingPtrs)
+				block->referencingPtrs->prev = this;
+			block->referencingPtrs = this;
+		}
+	}
+
+	this->block = block;
+	this->ptr = ptr;
+}
+
+/*
+ * Removes this BCPtr from its block's referencingPtrs list, so that moving it
+ * never touches state shared with other BCPtrs. Splits then no longer update
+ * it; normalise() must be called before use instead.
+ */
+template<typename T> void BlockCirclebuf<T>::BCPtr::detach()
+{
+	Block *block = this->block;
+	moveTo(NULL, ptr);
+	this->block = block;
+	detached = true;
+}
+
+/*
+ * Catches a detached BCPtr up with any splits of its block.
+ */
+template<typename T> void BlockCirclebuf<T>::BCPtr::normalise()
+{
+	while (ptr > block->getStartPtr() + block->getLength())
+		block = block->getNext();
+}
+
+template<typename T> uint64_t BlockCirclebuf<T>::BCPtr::getPos()
+{
+	return pos;
+}
+
+template<typename T>
+typename BlockCirclebuf<T>::Block *BlockCirclebuf<T>::BCPtr::getBlock()
+{
+	return block;
+}
+
+template<typename T>
+BlockCirclebuf<T>::Protection::Protection(uint64_t begin, uint64_t end)
+{
+	this->begin = begin;
+	this->end = end;
+	this->leased = false;
+	this->expired = false;
+	this->compressed = false;
+	this->scratchSegment = SIZE_MAX;
+	this->copyOnWrite = false;
+	this->version = 0;
+}
+
+template<typename T> uint64_t BlockCirclebuf<T>::Protection::getBegin()
+{
+	return begin;
+}
+
+template<typename T> uint64_t BlockCirclebuf<T>::Protection::getEnd()
+{
+	return end;
+}
+
+template<typename T> bool BlockCirclebuf<T>::Protection::isExpired()
+{
+	return expired || (leased && std::chrono::steady_clock::now() >= expiry);
+}
+
+template<typename T> bool BlockCirclebuf<T>::Protection::isCompressed()
+{
+	return compressed;
+}
+
+template<typename T> size_t BlockCirclebuf<T>::Protection::getCompressedSize()
+{
+	return arena.size();
+}
+
+template<typename T>
+BlockCirclebuf<T>::Snapshot::Snapshot(BlockCirclebuf *owner,
+				      Protection *protection)
+{
+	this->owner = owner;
+	this->protection = protection;
+}
+
+template<typename T>
+typename BlockCirclebuf<T>::Snapshot::Iterator
+BlockCirclebuf<T>::Snapshot::begin()
+{
+	return Iterator(this, protection->begin);
+}
+
+template<typename T>
+typename BlockCirclebuf<T>::Snapshot::Iterator BlockCirclebuf<T>::Snapshot::end()
+{
+	return Iterator(this, protection->end);
+}
+
+template<typename T> uint64_t BlockCirclebuf<T>::Snapshot::getBegin()
+{
+	return protection->begin;
+}
+
+template<typename T> uint64_t BlockCirclebuf<T>::Snapshot::getEnd()
+{
+	return protection->end;
+}
+
+template<typename T>
+size_t BlockCirclebuf<T>::Snapshot::read(uint64_t pos, T *buffer, size_t count)
+{
+	return owner->readProtected(protection, pos, buffer, count);
+}
+
+template<typename T>
+BlockCirclebuf<T>::Snapshot::Iterator::Iterator(Snapshot *snapshot,
+						uint64_t pos)
+{
+	this->snapshot = snapshot;
+	this->pos = pos;
+	this->ptr = NULL;
+	this->available = 0;
+	this->version = 0;
+}
+
+template<typename T> const T &BlockCirclebuf<T>::Snapshot::Iterator::operator*()
+{
+	//blocks copied aside since are about to be overwritten:
+	Protection *protection = snapshot->protection;
+	if (available == 0 || version != protection->version) {
+		T *found = NULL;
+		available = 0;
+		if (!snapshot->owner->locate(protection, pos, found, available))
+			throw std::out_of_range(
+				"Dereferenced a BlockCirclebuf snapshot iterator outside its snapshot");
+		ptr = found;
+		version = protection->version;
+	}
+	return *ptr;
+}
+
+template<typename T> const T *BlockCirclebuf<T>::Snapshot::Iterator::operator->()
+{
+	return &**this;
+}
+
+template<typename T>
+typename BlockCirclebuf<T>::Snapshot::Iterator &
+BlockCirclebuf<T>::Snapshot::Iterator::operator++()
+{
+	pos++;
+	if (available > 0) {
+		ptr++;
+		available--;
+	}
+	return *this;
+}
+
+template<typename T>
+bool BlockCirclebuf<T>::Snapshot::Iterator::operator==(
+	const Iterator &other) const
+{
+	return snapshot == other.snapshot && pos == other.pos;
+}
+
+template<typename T>
+bool BlockCirclebuf<T>::Snapshot::Iterator::operator!=(
+	const Iterator &other) const
+{
+	return !(*this == other);
+}
+
+template<typename T>
+uint64_t BlockCirclebuf<T>::Snapshot::Iterator::getPos() const
+{
+	return pos;
+}
+
+template<typename T>
+BlockCirclebuf<T>::Reader::Reader(const BCPtr &cursor, ReaderPolicy policy)
+	: cursor(cursor)
+{
+	this->policy = policy;
+	this->overrun = 0;
+}
+
+template<typename T> uint64_t BlockCirclebuf<T>::Reader::getPos()
+{
+	return cursor.pos;
+}
+
+template<typename T> uint64_t BlockCirclebuf<T>::Reader::getOverrun()
+{
+	return overrun;
+}
+
+template<typename T>
+typename BlockCirclebuf<T>::ReaderPolicy
+BlockCirclebuf<T>::Reader::getPolicy()
+{
+	return policy;
+}
+
+template<typename T>
+BlockCirclebuf<T>::SuperblockAllocation::SuperblockAllocation(
+	const SuperblockMemory &memory, size_t allocationLength,
+	BlockCirclebuf *owner)
+{
+	this->allocationStart = (T *)memory.start;
+	this->allocationLength = allocationLength;
+	this->owner = owner;
+	this->memory = memory;
+}
+
+template<typename T> BlockCirclebuf<T>::BlockPool::BlockPool()
+{
+	freeList = NULL;
+	numFree = 0;
+}
+
+template<typename T> BlockCirclebuf<T>::BlockPool::~BlockPool()
+{
+	for (Node *slab : slabs)
+		coreFree(slab);
+}
+
+/*
+ * Makes sure enough descriptors are free for a new superblock of
+ * `superblockBytes', adding a slab only for the shortfall.
+ */
+template<typename T>
+void BlockCirclebuf<T>::BlockPool::grow(size_t superblockBytes)
+{
+	size_t count = superblockBytes / bytesPerDescriptor;
+	if (count < minSlabDescriptors)
+		count = minSlabDescriptors;
+	if (numFree >= count)
+		return;
+	count -= numFree;
+	if (count < minSlabDescriptors)
+		count = minSlabDescriptors;
+	Node *slab = (Node *)coreAlloc(count * sizeof(Node));
+	slabs.push_back(slab);
+
+	for (size_t i = count; i > 0; i--) {
+		slab[i - 1].nextFree = freeList;
+		freeList = &slab[i - 1];
+	}
+	numFree += count;
+}
+
+/*
+ * Returns uninitialised storage for one Block.
+ */
+template<typename T> void *BlockCirclebuf<T>::BlockPool::allocate()
+{
+	if (!freeList)
+		grow(0);
+
+	Node *node = freeList;
+	freeList = node->nextFree;
+	numFree--;
+	return node->storage;
+}
+
+template<typename T> void BlockCirclebuf<T>::BlockPool::release(Block *block)
 {
-	this->allocationStart = allocationStart;
+	block->~Block();
+	Node *node = (Node *)(void *)block;
+	node->nextFree = freeList;
+	freeList = node;
+	numFree++;
 }
@@ -1,6 +1,17 @@
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
 #include <vector>
+#include "blockCirclebufTraits.hpp"
+#include "blockCompression.hpp"
+#include "keyframeIndex.hpp"
+#include "latencyHistogram.hpp"
+#include "superblockMemory.hpp"
+#include "timestampIndex.hpp"
 
 namespace ReplayWorkbench {
 
@@ -14,6 +25,182 @@ namespace ReplayWorkbench {
 template<typename T> class BlockCirclebuf {
 public:
 	class Block;
+	class BlockPool;
+
+	static const size_t cacheLineSize = 64;
+	//most the writer copies aside for copy-on-write snapshots in one go;
+	//larger blocks are split first and copied as the head reaches each
+	//piece:
+	static const size_t copyOnWriteChunkBytes = 64 * 1024;
+
+	/*
+	 * What write() does once there is nothing left it may overwrite.
+	 */
+	enum class OverflowPolicy {
+		//write as much as fits and discard the rest:
+		DROP,
+		//write nothing unless all of it fits:
+		REJECT
+	};
+
+	enum class WriteStatus {
+		OK,
+		//only part of the write fitted, the rest was discarded:
+		DROPPED,
+		//nothing was written, under OverflowPolicy::REJECT:
+		REJECTED
+	};
+
+	struct Config {
+		/*
+		 * Single-producer/single-consumer mode: one thread may call
+		 * write()/reserve()/commit() while another calls
+		 * read()/peek()/advance(), without locking. The writer never
+		 * evicts unread data in this mode; it only reuses a block once
+		 * the reader has consumed everything written to it, and never
+		 * wraps back round into the block it started in, so
+		 * `blockCount' should be greater than one.
+		 * Structural operations (splitting, protection) are not part of
+		 * the steady state and must be serialised with both threads by
+		 * the caller. Reconciliation is not done on the write path.
+		 */
+		bool concurrent;
+
+		/*
+		 * Number of equal blocks the initial superblock is divided
+		 * into.
+		 */
+		size_t blockCount;
+
+		/*
+		 * Back superblocks with huge pages where the system allows,
+		 * cutting TLB misses on large buffers.
+		 */
+		bool hugePages;
+
+		/*
+		 * Lock superblocks into RAM so long sessions are never swapped
+		 * out. Subject to RLIMIT_MEMLOCK.
+		 */
+		bool lockMemory;
+
+		/*
+		 * If set, superblocks are memory-mapped files in this
+		 * directory (which should be on local disk) instead of RAM,
+		 * allowing replay windows far larger than physical memory.
+		 * Takes precedence over `hugePages' and `lockMemory'.
+		 */
+		std::string backingDirectory;
+
+		/*
+		 * Growth policy: when fewer than `growthThreshold' elements are
+		 * left unprotected, or the head finds nothing writable, a new
+		 * superblock of `growthSize' elements is spliced in at the
+		 * head, as long as the total stays within `maxSize' elements.
+		 * A `growthSize' of zero disables growth. In concurrent mode
+		 * the buffer only grows once the head reaches the end of a
+		 * block. The memory for the next growth is allocated ahead of
+		 * time, at construction and by reclaim(), and superblocks the
+		 * buffer shrinks by are kept for it or freed by reclaim(), so
+		 * the writer makes no system calls for either unless it grows
+		 * again before reclaim() has set aside another.
+		 */
+		size_t growthThreshold;
+		size_t growthSize;
+		size_t maxSize;
+
+		/*
+		 * Applies once the head finds nothing writable, after growing
+		 * (if enabled) and, outside concurrent mode, releasing any
+		 * expired protection leases.
+		 * Writes never wait for space either way. Under REJECT, a
+		 * write larger than the buffer could ever hold unprotected is
+		 * turned away up front; one that only runs into protected
+		 * blocks part way may still have evicted the data it would
+		 * have overwritten.
+		 */
+		OverflowPolicy overflowPolicy;
+
+		/*
+		 * Leave merging blocks back together to coalesce(), instead of
+		 * doing it as the head passes them or as protections are
+		 * released, so the writer only notes that there is work to do
+		 * and never walks a block's BCPtrs. Has no effect in
+		 * concurrent mode, where blocks are never merged.
+		 */
+		bool deferReconcile;
+
+		/*
+		 * Passed to the codec by compress(), trading speed for ratio.
+		 */
+		int compressionLevel;
+
+		/*
+		 * If nonzero, the writer logs stats() about this often, checked
+		 * as the head moves between blocks.
+		 */
+		std::chrono::steady_clock::duration statsLogInterval;
+
+		/*
+		 * Keep latency histograms (see getLatencies()). Costs two
+		 * clock reads per timed operation.
+		 */
+		bool recordLatency;
+
+		Config()
+			: concurrent(false),
+			  blockCount(1),
+			  hugePages(false),
+			  lockMemory(false),
+			  growthThreshold(0),
+			  growthSize(0),
+			  maxSize(0),
+			  overflowPolicy(OverflowPolicy::DROP),
+			  deferReconcile(false),
+			  compressionLevel(1),
+			  statsLogInterval(
+				  std::chrono::steady_clock::duration::zero()),
+			  recordLatency(false)
+		{
+		}
+	};
+
+	/*
+	 * Snapshot of the buffer's counters, taken by stats(). Totals count
+	 * from construction; sizes are as of the last structural change.
+	 */
+	struct Stats {
+		uint64_t bytesWritten;
+		uint64_t bytesRead;
+		//unread data the writer discarded to make room, and how many
+		//times it had to:
+		uint64_t bytesEvicted;
+		uint64_t tailOverruns;
+		//write-protected blocks the head passed over:
+		uint64_t protectedBlocksSkipped;
+		uint64_t splits;
+		uint64_t reconciles;
+		size_t blockCount;
+		size_t protectedBytes;
+		//longest run of unprotected blocks, i.e. the most the head can
+		//write before it has to skip protected data:
+		size_t largestFreeSpan;
+	};
+
+	/*
+	 * Latency histograms kept under Config::recordLatency, in
+	 * nanoseconds.
+	 */
+	struct Latencies {
+		LatencyHistogram write;
+		LatencyHistogram split;
+		LatencyHistogram protect;
+		LatencyHistogram unprotect;
+		//from protect() until unprotect(), which for a replay save
+		//spans the hotkey's protectRange() to unprotect() once the
+		//clip's file is closed. Snapshots are not counted:
+		LatencyHistogram protectionLifetime;
+	};
 
 	/*
 	 * `Superblock' of blocks declared within a single memory allocation.
@@ -22,31 +209,235 @@ public:
 	 */
 	struct SuperblockAllocation {
 		T *allocationStart;
+		size_t allocationLength;
+		BlockCirclebuf *owner;
+		SuperblockMemory memory;
+
+		SuperblockAllocation(const SuperblockMemory &memory,
+				     size_t allocationLength,
+				     BlockCirclebuf *owner);
+	};
+
+	/*
+	 * What happens to a reader cursor when the writer needs to evict data
+	 * it has not read yet.
+	 */
+	enum class ReaderPolicy {
+		//the writer stops short of the reader's unread data, dropping
+		//whatever it cannot fit:
+		RETAIN,
+		//the reader is dragged forward with the tail, and the elements
+		//it missed are added to its overrun count:
+		OVERRUN
+	};
 
-		SuperblockAllocation(T *allocationStart);
+	/*
+	 * Contiguous run of elements: within a single block, as handed out by
+	 * the zero-copy paths, or a record passed to writev().
+	 */
+	struct Span {
+		T *ptr;
+		size_t length;
 	};
 
 	/*
-	 * Pointer to a position in the BlockCirclebuf
+	 * Pointer to a position in the BlockCirclebuf. As well as its physical
+	 * location, each BCPtr carries a monotonic `logical position': the
+	 * number of elements written to the buffer before the element it
+	 * points to. Distances between BCPtrs are then a plain subtraction,
+	 * independent of how many blocks lie between them.
 	 */
 	class BCPtr {
+		friend class BlockCirclebuf;
+		friend class Block;
+
 	private:
 		Block *block;
 		T *ptr;
+		uint64_t pos;
 		BCPtr *next;
 		BCPtr *prev;
+		bool detached;
+
+		void moveTo(Block *block, T *ptr);
+		void detach();
+		void normalise();
 
 	public:
-		BCPtr(Block *block, T *ptr);
-		BCPtr(BCPtr &copy);
+		BCPtr();
+		BCPtr(Block *block, T *ptr, uint64_t pos = 0);
+		BCPtr(const BCPtr &copy);
 		~BCPtr();
 		BCPtr &operator=(const BCPtr &other);
+		uint64_t getPos();
+		Block *getBlock();
+	};
+
+	/*
+	 * Independent read cursor over the buffer's history. Readers do not
+	 * consume data for each other: only eviction (or advancing the
+	 * buffer's own tail) discards anything.
+	 */
+	class Reader {
+		friend class BlockCirclebuf;
+
+	private:
+		BCPtr cursor;
+		ReaderPolicy policy;
+		uint64_t overrun;
+
+		Reader(const BCPtr &cursor, ReaderPolicy policy);
+
+	public:
+		uint64_t getPos();
+		uint64_t getOverrun();
+		ReaderPolicy getPolicy();
+	};
+
+	/*
+	 * Handle for a range of the buffer protected by protect(). The range
+	 * stays write-protected until the handle is passed to unprotect().
+	 * Handles may overlap: blocks they share stay protected until every
+	 * handle holding them has been released.
+	 */
+	class Protection {
+		friend class BlockCirclebuf;
+
+	private:
+		//consecutive blocks protected, from the start of `first' to
+		//the end of `last', so splits and growth at the head never
+		//change which blocks a run covers. `pos' is the logical
+		//position of its first element:
+		struct Run {
+			uint64_t pos;
+			BCPtr first;
+			BCPtr last;
+		};
+
+		uint64_t begin;
+		uint64_t end;
+		std::vector<Run> runs;
+		//leases are released automatically once past their expiry:
+		bool leased;
+		std::chrono::steady_clock::time_point expiry;
+		bool expired;
+
+		//once compressed, the range is held in `arena' instead of
+		//the blocks, one segment per block it covered:
+		struct Segment {
+			uint64_t pos;
+			size_t length;
+			size_t offset;
+			size_t compressedBytes;
+		};
+		bool compressed;
+		std::vector<char> arena;
+		std::vector<Segment> segments;
+		//the segment last decompressed, for sequential reads:
+		std::vector<T> scratch;
+		size_t scratchSegment;
+
+		//copy-on-write holds don't stop the writer, which instead
+		//copies each block aside here just before overwriting it,
+		//bumping `version'. Kept in position order:
+		struct Copy {
+			uint64_t pos;
+			std::vector<T> data;
+		};
+		bool copyOnWrite;
+		std::vector<Copy> copies;
+		uint64_t version;
+
+		//when protect() took the range, under Config::recordLatency:
+		std::chrono::steady_clock::time_point heldSince;
+
+		Protection(uint64_t begin, uint64_t end);
+
+	public:
+		uint64_t getBegin();
+		uint64_t getEnd();
+
+		/*
+		 * Whether a lease has run out, after which its data may be
+		 * overwritten at any time. The handle itself stays valid
+		 * until passed to unprotect().
+		 */
+		bool isExpired();
+
+		bool isCompressed();
+		size_t getCompressedSize();
+	};
+
+	/*
+	 * Read-only view of a range of the buffer as it was when taken by
+	 * snapshot(). Reads see the same data however far the writer has got
+	 * since: copy-on-write snapshots leave the writer free to overwrite
+	 * their blocks, each being copied aside just before it is, and others
+	 * pin their blocks as protect() does.
+	 */
+	class Snapshot {
+		friend class BlockCirclebuf;
+
+	private:
+		BlockCirclebuf *owner;
+		Protection *protection;
+
+		Snapshot(BlockCirclebuf *owner, Protection *protection);
+
+	public:
+		/*
+		 * Forward iterator over the snapshot's elements, reading
+		 * straight out of the buffer or the copies taken from it.
+		 * Stays valid across writes, but not once the snapshot is
+		 * released. Dereferencing one outside the snapshot, such as
+		 * end(), throws std::out_of_range.
+		 */
+		class Iterator {
+			friend class Snapshot;
+
+		private:
+			Snapshot *snapshot;
+			uint64_t pos;
+			//elements contiguous with `pos', found on first use:
+			const T *ptr;
+			size_t available;
+			uint64_t version;
+
+			Iterator(Snapshot *snapshot, uint64_t pos);
+
+		public:
+			const T &operator*();
+			const T *operator->();
+			Iterator &operator++();
+			bool operator==(const Iterator &other) const;
+			bool operator!=(const Iterator &other) const;
+			uint64_t getPos() const;
+		};
+
+		Iterator begin();
+		Iterator end();
+		uint64_t getBegin();
+		uint64_t getEnd();
+
+		/*
+		 * Copies up to `count' elements from logical position `pos',
+		 * returning the number copied.
+		 */
+		size_t read(uint64_t pos, T *buffer, size_t count);
 	};
 
 	class Block {
+		friend class BlockCirclebuf;
+		friend class BCPtr;
+
 	private:
 		SuperblockAllocation *parentSuperblock;
-		bool writeProtect;
+		//number of protections holding the block; the head skips it
+		//while any are left:
+		size_t protectCount;
+		//number of copy-on-write snapshots holding the block, which
+		//the writer copies it out to before overwriting it:
+		size_t cowCount;
 		bool readProtect;
 		T *blockStart;
 		size_t blockLength;
@@ -55,6 +446,13 @@ public:
 		bool willReconcilePrev;
 		bool willReconcileNext;
 		BCPtr *referencingPtrs;
+		//logical position just past the last element written here:
+		uint64_t lastWritePos;
+		//logical position of the first element written here since the
+		//head last entered the block, or UINT64_MAX before it has. A
+		//concurrent reader goes by this rather than by what the writer
+		//has since spliced in or released ahead of it:
+		std::atomic<uint64_t> firstWritePos;
 
 	public:
 		Block(SuperblockAllocation *parentSuperblock, T *blockStart,
@@ -78,22 +476,373 @@ public:
 		 */
 		Block(SuperblockAllocation *parentSuperblock, T *blockStart,
 		      size_t blockLength);
+		void releaseCopyOnWrite();
+		void reconcileReleased();
+	};
+
+	/*
+	 * Free-list pool of Block descriptors for a single buffer. Descriptors
+	 * are carved out of slabs sized from the superblocks they describe, so
+	 * splitting and reconciling never touch the global allocator once the
+	 * pool is warm, and a buffer's descriptors stay close together.
+	 * Descriptors freed by releasing a superblock are reused for the next
+	 * one, so repeated growth and reclaim does not add slabs.
+	 */
+	class BlockPool {
+	private:
+		union Node {
+			Node *nextFree;
+			alignas(Block) unsigned char storage[sizeof(Block)];
+		};
+
+		std::vector<Node *> slabs;
+		Node *freeList;
+		size_t numFree;
+
+	public:
+		//one descriptor is provisioned per this many bytes of superblock:
+		static const size_t bytesPerDescriptor = 64 * 1024;
+		static const size_t minSlabDescriptors = 16;
+
+		BlockPool();
+		BlockPool(const BlockPool &) = delete;
+		~BlockPool();
+		void grow(size_t superblockBytes);
+		void *allocate();
+		void release(Block *block);
 	};
 
 private:
-	std::vector<SuperblockAllocation> superblockAllocations;
-	BCPtr head;
-	BCPtr tail;
+	typedef BlockCirclebufTraits<T> Traits;
+
+	Config config;
+	BlockPool blockPool;
+	std::vector<SuperblockAllocation *> superblockAllocations;
+	//so that growing and shrinking make no system calls on the writer's
+	//path: the superblock the next growth will splice in, and those
+	//released since the last reclaim(), which frees them:
+	SuperblockAllocation *spareSuperblock;
+	std::vector<SuperblockAllocation *> retiredSuperblocks;
+	//total elements across all superblocks, and how many of them are
+	//currently write-protected. Reclaiming never shrinks the buffer below
+	//the size it was constructed with:
+	size_t capacity;
+	size_t protectedLength;
+	size_t baseCapacity;
+	//the capacity reclaim() last reported, as the writer does not log:
+	size_t loggedCapacity;
+	//blocks are flagged for coalesce() to merge:
+	bool reconcilePending;
 
+	//counters for stats(), in elements. Each belongs to one thread, so is
+	//updated with relaxed loads and stores rather than read-modify-writes:
+	struct WriterCounters {
+		std::atomic<uint64_t> written;
+		std::atomic<uint64_t> evicted;
+		std::atomic<uint64_t> tailOverruns;
+		std::atomic<uint64_t> blocksSkipped;
+		std::atomic<uint64_t> splits;
+		std::atomic<uint64_t> reconciles;
+		std::atomic<size_t> blockCount;
+		std::atomic<size_t> protectedLength;
+		std::atomic<size_t> largestFreeSpan;
+		//set as protection or growth changes the layout, for stats()
+		//to bring largestFreeSpan up to date:
+		std::atomic<bool> layoutChanged;
+	};
+	struct ReaderCounters {
+		std::atomic<uint64_t> read;
+	};
+
+	//writer and reader state are kept on separate cache lines:
+	alignas(cacheLineSize) BCPtr head;
+	std::atomic<uint64_t> publishedHeadPos;
+	//the path reserve() last handed out, which commit() follows:
+	struct Reservation {
+		Block *block;
+		T *ptr;
+		size_t length;
+	};
+	std::vector<Reservation> reservations;
+	//scratch for the copying write paths, kept to spare an allocation
+	//per call:
+	std::vector<Span> writeSpans;
+	WriterCounters writerCounters;
+	std::chrono::steady_clock::time_point nextStatsLog;
+	alignas(cacheLineSize) BCPtr tail;
+	std::atomic<uint64_t> publishedTailPos;
+	ReaderCounters readerCounters;
+	//likewise for the copying read paths:
+	std::vector<Span> readSpans;
+
+	std::vector<Reader *> readers;
+	std::vector<Protection *> protections;
+	std::vector<Snapshot *> snapshots;
+	//no lease expires before this:
+	std::chrono::steady_clock::time_point nextLeaseExpiry;
+	TimestampIndex timestampIndex;
+	KeyframeIndex keyframeIndex;
+	//NULL unless Config::recordLatency is set:
+	Latencies *latencies;
+
+	SuperblockAllocation *newSuperblockAllocation(size_t size);
+	SuperblockAllocation *addSuperblockAllocation(size_t size);
+	void freeSuperblock(SuperblockAllocation *superblock);
+	void prepareGrowth();
 	Block *allocateSuperblock(size_t size);
+	bool canOverwrite(Block *block);
+	uint64_t evictionLimit();
+	Block *nextWritableBlock(Block *block);
+	Block *nextWritableOrGrow(Block *block);
+	Block *grow(Block *block, T *ptr);
+	size_t reclaimIdle(uint64_t writePos, const std::vector<Span> &reserved);
+	bool isIdle(SuperblockAllocation *superblock,
+		    const std::vector<Span> &reserved);
+	void releaseSuperblock(SuperblockAllocation *superblock);
+	void moveHead(Block *block, T *ptr);
+	void restHeadBehind();
+	void advanceCursor(BCPtr &cursor, size_t count);
+	void moveToNextBlock(BCPtr &cursor);
+	bool continuesIn(Block *block, uint64_t pos);
+	void syncReaders();
+	size_t readable();
+	size_t peekFrom(BCPtr &cursor, size_t available,
+			std::vector<Span> &spans, size_t count);
+	void trimIndices();
+	void blocksInRange(BCPtr &begin, BCPtr &end,
+			   std::vector<Block *> &blocks);
+	Protection *hold(const BCPtr &begin, const BCPtr &end,
+			 bool copyOnWrite);
+	void releaseProtection(Protection *protection);
+	void dropProtection(Protection *protection);
+	void copyBeforeWrite(Block *block);
+	bool locate(Protection *protection, uint64_t pos, T *&ptr,
+		    size_t &available);
+	void reconcileOrDefer(Block *block);
+	size_t writableCapacity();
+	static void truncateSpans(std::vector<Span> &spans, size_t count);
+	template<typename Count>
+	static void addRelaxed(std::atomic<Count> &counter, uint64_t delta);
+	template<typename Count>
+	static void subtractRelaxed(std::atomic<Count> &counter,
+				    uint64_t delta);
+	void layoutChanged();
+	void updateLayoutStats();
 
 public:
-	BlockCirclebuf(size_t size);
-	void allocateSuperblock(size_t size, Block *prev, Block *next);
-	void write(T *input, size_t count);
+	BlockCirclebuf(size_t size, const Config &config = Config());
+	BlockCirclebuf(const BlockCirclebuf &) = delete;
+	~BlockCirclebuf();
+	Block *allocateSuperblock(size_t size, Block *prev, Block *next);
+
+	/*
+	 * Copies `count' elements in at the head, through the element traits:
+	 * elements of non-trivially-copyable types are moved from `input'.
+	 * Never blocks: if the buffer runs out of space the configured
+	 * overflow policy decides what is kept, as reported by the status.
+	 */
+	WriteStatus write(T *input, size_t count);
+
+	/*
+	 * write() of a record presented at `timestamp', which is added to the
+	 * timestamp index, and to the keyframe index if `keyframe' is set
+	 * (from the packet's flags, or isH264Keyframe()/isHevcKeyframe()).
+	 * Records written by other means can be indexed through
+	 * getTimestampIndex() and getKeyframeIndex(), e.g. from writev()'s
+	 * positions. Only records written in full are indexed: rejected ones
+	 * and those cut short under OverflowPolicy::DROP are not.
+	 */
+	WriteStatus write(T *input, size_t count, int64_t timestamp,
+			  bool keyframe = false);
+
+	/*
+	 * Writes a batch of records back to back, as consecutive write()
+	 * calls would, but reserving and committing across the whole batch at
+	 * once. `positions' receives the logical position each record written
+	 * in full starts at, for indexing. Returns the number of such records;
+	 * under OverflowPolicy::REJECT no record is written in part, and the
+	 * batch stops short of the first record that could never fit, as
+	 * write() would, before anything is evicted for it.
+	 */
+	size_t writev(const std::vector<Span> &records,
+		      std::vector<uint64_t> &positions);
+
 	size_t read(T *buffer, size_t count);
+
+	/*
+	 * In-place write: fills `spans' with up to `count' writable elements
+	 * at the head, skipping write-protected blocks. Any unread data in the
+	 * reserved range is evicted up front, so the caller may fill the
+	 * spans directly. Returns the number of elements reserved, which is
+	 * less than `count' only if the buffer cannot hold that many.
+	 * commit() then publishes the first `count' reserved elements. Unless
+	 * T is trivially copyable the spans hold live objects to assign over.
+	 */
+	size_t reserve(std::vector<Span> &spans, size_t count);
+	void commit(size_t count);
+
+	/*
+	 * Zero-copy read: fills `spans' with up to `count' elements starting
+	 * at the tail, one span per block crossed, without moving the tail.
+	 * Returns the number of elements covered. The spans stay valid until
+	 * the next write; call advance() once they have been consumed.
+	 */
+	size_t peek(std::vector<Span> &spans, size_t count);
+	void advance(size_t count);
+
+	/*
+	 * Registers a new reader, starting at the oldest data in the buffer.
+	 * Readers are not available in concurrent mode.
+	 */
+	Reader *addReader(ReaderPolicy policy);
+	void removeReader(Reader *reader);
+	size_t readerLag(Reader *reader);
+	size_t peek(Reader *reader, std::vector<Span> &spans, size_t count);
+	void advance(Reader *reader, size_t count);
+	size_t read(Reader *reader, T *buffer, size_t count);
+
+	/*
+	 * Unlinks and frees superblocks grown earlier that no longer hold
+	 * protected or live data, or anything a BCPtr references, as long as
+	 * the buffer stays at least its original size. Live data further
+	 * behind the head than that original size is outside the retention
+	 * window and is dropped first, except in concurrent mode, where
+	 * unread data is never dropped. Returns the number of elements
+	 * released. Called automatically as the head moves between
+	 * blocks, except in concurrent mode, where it must be serialised with
+	 * both threads by the caller. Only a call from outside the writer
+	 * returns memory to the system and allocates the next growth ahead
+	 * of time, so call it periodically from a maintenance step either way.
+	 */
+	size_t reclaim();
+
+	/*
+	 * Maintenance step for Config::deferReconcile: merges up to
+	 * `maxMerges' pairs of blocks whose reconciliation was left to it,
+	 * returning the number merged. Walks the whole ring when there is
+	 * anything to do. Must be serialised with the writer, e.g. called
+	 * from the same thread between frames.
+	 */
+	size_t coalesce(size_t maxMerges = SIZE_MAX);
+
+	/*
+	 * Logical position of the first record written at or after
+	 * `timestamp', if it is still in the buffer. O(log n) in the number of
+	 * indexed records. In concurrent mode this belongs to the writer.
+	 */
+	bool positionAt(int64_t timestamp, uint64_t &pos);
+	TimestampIndex &getTimestampIndex();
+	KeyframeIndex &getKeyframeIndex();
+
+	/*
+	 * Write-protects the data from `begin' up to `end', splitting the
+	 * blocks at either end, in time linear in the number of blocks
+	 * covered. Both must still be in the live stream, or
+	 * std::out_of_range is thrown, as for ptrAt(). Protected data is excluded from the live stream once the
+	 * head passes it, but stays in place for export.
+	 * A nonzero `ttl' makes the protection a lease, released by
+	 * expireLeases() once it expires unless renewed first, so a stuck
+	 * export cannot hold on to capacity for ever. Expired handles must
+	 * still be passed to unprotect().
+	 */
+	Protection *protect(const BCPtr &begin, const BCPtr &end,
+			    std::chrono::steady_clock::duration ttl =
+				    std::chrono::steady_clock::duration::zero());
+	void unprotect(Protection *protection);
+
+	/*
+	 * Extends a lease to expire `ttl' from now. Returns false if it has
+	 * already expired, in which case its data may have been overwritten.
+	 */
+	bool renew(Protection *protection,
+		   std::chrono::steady_clock::duration ttl);
+
+	/*
+	 * Releases every lease past its expiry. The writer does this itself
+	 * as it reserves space, except in concurrent mode, where expiry is
+	 * left to the export side: call it from there, serialised with both
+	 * threads like protect() and unprotect().
+	 */
+	void expireLeases();
+
+	/*
+	 * Compresses a protected range into a side arena and gives its blocks
+	 * back to the writer, so saved clips waiting for export take up less
+	 * of the buffer. Only for trivially copyable T, and only in builds
+	 * with a codec (see compressionCodecName()); returns false otherwise,
+	 * leaving the protection as it was. CPU-heavy, so meant for a
+	 * maintenance step rather than the capture path.
+	 */
+	bool compress(Protection *protection);
+
+	/*
+	 * Copies up to `count' elements of a protected range, starting at
+	 * logical position `pos', decompressing it if need be. Returns the
+	 * number copied, which is 0 once a lease has expired.
+	 */
+	size_t readProtected(Protection *protection, uint64_t pos, T *buffer,
+			     size_t count);
+
+	/*
+	 * Takes a consistent view of the data from `begin' up to `end', for
+	 * exports too slow to keep ahead of the writer. A copy-on-write
+	 * snapshot costs nothing until the writer reaches one of its blocks,
+	 * which is then copied aside as part of that write, at most
+	 * `copyOnWriteChunkBytes' at a time; otherwise, and
+	 * always in concurrent mode, the blocks are pinned instead. The
+	 * snapshot must be serialised with the writer like protect().
+	 */
+	Snapshot *snapshot(const BCPtr &begin, const BCPtr &end,
+			   bool copyOnWrite = true);
+	void releaseSnapshot(Snapshot *snapshot);
+
+	/*
+	 * protect() between two logical positions in the live stream. `from'
+	 * is first moved back to the nearest indexed keyframe, or if none is
+	 * left that early, forward to the first one before `to', so the range
+	 * starts decodable; see the handle for where it actually begins.
+	 */
+	Protection *protectRange(uint64_t from, uint64_t to,
+				 std::chrono::steady_clock::duration ttl =
+					 std::chrono::steady_clock::duration::zero());
+
+	/*
+	 * BCPtr to logical position `pos', which must lie between the tail and
+	 * the head. Walks the live stream from the tail, so is linear in the
+	 * number of blocks.
+	 */
+	BCPtr ptrAt(uint64_t pos);
+
+	const std::vector<SuperblockAllocation *> &getSuperblocks();
 	size_t ptrDifference(BCPtr &a, BCPtr &b);
 	size_t bufferHealth();
+
+	/*
+	 * Reads the counters kept on the write and read paths. Cheap, and
+	 * safe to call from any thread, including alongside a concurrent
+	 * writer and reader; the fields are read independently, so may be
+	 * slightly out of step with each other. The exception is the first
+	 * call after protection or growth changed the layout, which walks
+	 * the ring to find the largest free span, so must be serialised with
+	 * the writer like protect(), as the logging under
+	 * Config::statsLogInterval is.
+	 */
+	Stats stats();
+
+	/*
+	 * Logs stats() at info level, as Config::statsLogInterval does.
+	 */
+	void logStats();
+
+	/*
+	 * Latency histograms for write(), Block::split(), protect(),
+	 * unprotect() and how long protections are held, or NULL unless
+	 * Config::recordLatency is set. May be read, or logged with
+	 * logLatencies(), from any thread at any time; each histogram can be
+	 * reset() between sessions.
+	 */
+	Latencies *getLatencies();
+	void logLatencies();
 };
 }
 
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstddef>
+#include <cstring>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include "streamingCopy.hpp"
+
+namespace ReplayWorkbench {
+
+/*
+ * How a BlockCirclebuf<T> manages the elements in its superblocks, chosen at
+ * compile time. Trivially copyable types are left uninitialised and copied in
+ * bulk with memcpy, large writes bypassing the cache as they are not read
+ * back soon. Any other type is default-constructed across each superblock
+ * when it is allocated, so every slot always holds a live object; writes then
+ * move elements in by destroying the old occupant and move-constructing over
+ * it with placement new, and reads copy-assign them out, since several
+ * readers may see the same element.
+ *
+ * Packet or descriptor types that need something else (e.g. reference
+ * counted payloads that are cheaper to swap) can supply their own by fully
+ * specialising BlockCirclebufTraits<T> with the same four functions.
+ */
+template<typename T, typename Enable = void> struct BlockCirclebufTraits {
+	static void construct(T *ptr, size_t count)
+	{
+		for (size_t i = 0; i < count; i++)
+			new (ptr + i) T();
+	}
+
+	static void destroy(T *ptr, size_t count)
+	{
+		for (size_t i = 0; i < count; i++)
+			ptr[i].~T();
+	}
+
+	static void copyIn(T *dest, T *src, size_t count)
+	{
+		for (size_t i = 0; i < count; i++) {
+			dest[i].~T();
+			new (dest + i) T(std::move(src[i]));
+		}
+	}
+
+	static void copyOut(T *dest, const T *src, size_t count)
+	{
+		for (size_t i = 0; i < count; i++)
+			dest[i] = src[i];
+	}
+};
+
+template<typename T>
+struct BlockCirclebufTraits<
+	T, typename std::enable_if<std::is_trivially_copyable<T>::value>::type> {
+	static void construct(T *, size_t) {}
+
+	static void destroy(T *, size_t) {}
+
+	static void copyIn(T *dest, T *src, size_t count)
+	{
+		if (count * sizeof(T) >= streamingCopyThreshold)
+			streamingCopy(dest, src, count * sizeof(T));
+		else
+			memcpy(dest, src, count * sizeof(T));
+	}
+
+	static void copyOut(T *dest, const T *src, size_t count)
+	{
+		memcpy(dest, src, count * sizeof(T));
+	}
+};
+}
@@ -0,0 +1,113 @@
+#include "blockCompression.hpp"
+
+#if defined(HAVE_ZSTD)
+#include <zstd.h>
+#elif defined(HAVE_LZ4)
+#include <lz4.h>
+#endif
+
+using namespace ReplayWorkbench;
+
+#if defined(HAVE_ZSTD)
+
+bool ReplayWorkbench::compressionAvailable()
+{
+	return true;
+}
+
+const char *ReplayWorkbench::compressionCodecName()
+{
+	return "zstd";
+}
+
+size_t ReplayWorkbench::compressionBound(size_t bytes)
+{
+	return ZSTD_compressBound(bytes);
+}
+
+size_t ReplayWorkbench::compressBytes(void *dest, size_t destCapacity,
+				      const void *src, size_t bytes, int level)
+{
+	size_t result = ZSTD_compress(dest, destCapacity, src, bytes, level);
+	return ZSTD_isError(result) ? 0 : result;
+}
+
+bool ReplayWorkbench::decompressBytes(void *dest, size_t bytes,
+				      const void *src, size_t compressedBytes)
+{
+	size_t result = ZSTD_decompress(dest, bytes, src, compressedBytes);
+	return !ZSTD_isError(result) && result == bytes;
+}
+
+#elif defined(HAVE_LZ4)
+
+bool ReplayWorkbench::compressionAvailable()
+{
+	return true;
+}
+
+const char *ReplayWorkbench::compressionCodecName()
+{
+	return "lz4";
+}
+
+size_t ReplayWorkbench::compressionBound(size_t bytes)
+{
+	if (bytes > LZ4_MAX_INPUT_SIZE)
+		return 0;
+	return LZ4_compressBound((int)bytes);
+}
+
+size_t ReplayWorkbench::compressBytes(void *dest, size_t destCapacity,
+				      const void *src, size_t bytes, int level)
+{
+	//LZ4 has no levels to speak of; higher levels here mean less
+	//acceleration, down to the default:
+	int acceleration = level < 1 ? 1 - level : 1;
+	if (bytes > LZ4_MAX_INPUT_SIZE || destCapacity > LZ4_MAX_INPUT_SIZE)
+		return 0;
+	int result = LZ4_compress_fast((const char *)src, (char *)dest,
+				       (int)bytes, (int)destCapacity,
+				       acceleration);
+	return result > 0 ? (size_t)result : 0;
+}
+
+bool ReplayWorkbench::decompressBytes(void *dest, size_t bytes,
+				      const void *src, size_t compressedBytes)
+{
+	if (bytes > LZ4_MAX_INPUT_SIZE || compressedBytes > LZ4_MAX_INPUT_SIZE)
+		return false;
+	int result = LZ4_decompress_safe((const char *)src, (char *)dest,
+					 (int)compressedBytes, (int)bytes);
+	return result >= 0 && (size_t)result == bytes;
+}
+
+#else
+
+bool ReplayWorkbench::compressionAvailable()
+{
+	return false;
+}
+
+const char *ReplayWorkbench::compressionCodecName()
+{
+	return "none";
+}
+
+size_t ReplayWorkbench::compressionBound(size_t)
+{
+	return 0;
+}
+
+size_t ReplayWorkbench::compressBytes(void *, size_t, const void *, size_t,
+				      int)
+{
+	return 0;
+}
+
+bool ReplayWorkbench::decompressBytes(void *, size_t, const void *, size_t)
+{
+	return false;
+}
+
+#endif
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstddef>
+
+namespace ReplayWorkbench {
+
+/*
+ * Lossless codec for protected data waiting to be exported: zstd or LZ4,
+ * whichever the build found (zstd preferred), or none, in which case
+ * compressionAvailable() is false and nothing is compressed.
+ */
+bool compressionAvailable();
+
+/*
+ * Name of the codec in use, for logging.
+ */
+const char *compressionCodecName();
+
+/*
+ * Largest compressed size `bytes' of input can produce.
+ */
+size_t compressionBound(size_t bytes);
+
+/*
+ * Compresses `bytes' from `src' into `dest', which holds `destCapacity'.
+ * `level' trades speed for ratio where the codec supports it. Returns the
+ * compressed size, or 0 on failure.
+ */
+size_t compressBytes(void *dest, size_t destCapacity, const void *src,
+		     size_t bytes, int level);
+
+/*
+ * Decompresses `compressedBytes' from `src' into exactly `bytes' at `dest'.
+ */
+bool decompressBytes(void *dest, size_t bytes, const void *src,
+		     size_t compressedBytes);
+}
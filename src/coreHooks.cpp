@@ -0,0 +1,59 @@
+#include "coreHooks.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+using namespace ReplayWorkbench;
+
+static void *defaultAllocate(size_t bytes)
+{
+	void *ptr = malloc(bytes ? bytes : 1);
+	if (!ptr)
+		throw std::bad_alloc();
+	return ptr;
+}
+
+static void defaultLog(int level, const char *format, va_list args)
+{
+	const char *prefix = level <= CORE_LOG_ERROR     ? "error"
+			     : level <= CORE_LOG_WARNING ? "warning"
+			     : level <= CORE_LOG_INFO    ? "info"
+							 : "debug";
+	fprintf(stderr, "%s: ", prefix);
+	vfprintf(stderr, format, args);
+	fputc('\n', stderr);
+}
+
+static CoreHooks hooks = {defaultAllocate, free, defaultLog};
+
+void ReplayWorkbench::setCoreHooks(const CoreHooks &newHooks)
+{
+	hooks.allocate = newHooks.allocate ? newHooks.allocate
+					   : defaultAllocate;
+	hooks.release = newHooks.release ? newHooks.release : free;
+	hooks.log = newHooks.log ? newHooks.log : defaultLog;
+}
+
+const CoreHooks &ReplayWorkbench::getCoreHooks()
+{
+	return hooks;
+}
+
+void *ReplayWorkbench::coreAlloc(size_t bytes)
+{
+	return hooks.allocate(bytes);
+}
+
+void ReplayWorkbench::coreFree(void *ptr)
+{
+	hooks.release(ptr);
+}
+
+void ReplayWorkbench::coreLog(int level, const char *format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	hooks.log(level, format, args);
+	va_end(args);
+}
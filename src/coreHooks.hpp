@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstdarg>
+#include <cstddef>
+
+namespace ReplayWorkbench {
+
+/*
+ * Log levels passed to the logging hook. The values match libobs' LOG_*
+ * levels, so the plugin can forward messages to blogva() unchanged.
+ */
+enum CoreLogLevel {
+	CORE_LOG_ERROR = 100,
+	CORE_LOG_WARNING = 200,
+	CORE_LOG_INFO = 300,
+	CORE_LOG_DEBUG = 400
+};
+
+/*
+ * Allocator and logging used by the buffer and its supporting code, which
+ * otherwise has no dependency on libobs. The defaults are malloc()/free()
+ * and printing to stderr; the plugin replaces them with bmalloc()/bfree()
+ * and blogva() when it loads, so standalone builds (benchmarks, soak tests,
+ * runs under perf or valgrind) go through the same code path the plugin
+ * does. Install hooks before creating any buffer, and do not change the
+ * allocator while memory from the old one is still live.
+ */
+struct CoreHooks {
+	void *(*allocate)(size_t bytes);
+	void (*release)(void *ptr);
+	void (*log)(int level, const char *format, va_list args);
+};
+
+void setCoreHooks(const CoreHooks &hooks);
+const CoreHooks &getCoreHooks();
+
+void *coreAlloc(size_t bytes);
+void coreFree(void *ptr);
+void coreLog(int level, const char *format, ...)
+#if defined(__GNUC__) || defined(__clang__)
+	__attribute__((format(printf, 2, 3)))
+#endif
+	;
+}
@@ -0,0 +1,92 @@
+#include "keyframeIndex.hpp"
+
+#include <algorithm>
+
+namespace ReplayWorkbench {
+
+void KeyframeIndex::append(uint64_t pos)
+{
+	//several keyframes in one record only need indexing once:
+	if (!positions.empty() && positions.back() >= pos)
+		return;
+	positions.push_back(pos);
+}
+
+void KeyframeIndex::trim(uint64_t tailPos)
+{
+	while (!positions.empty() && positions.front() < tailPos)
+		positions.pop_front();
+}
+
+bool KeyframeIndex::previous(uint64_t pos, uint64_t &keyframePos) const
+{
+	auto keyframe =
+		std::upper_bound(positions.begin(), positions.end(), pos);
+	if (keyframe == positions.begin())
+		return false;
+
+	keyframePos = *(keyframe - 1);
+	return true;
+}
+
+bool KeyframeIndex::next(uint64_t pos, uint64_t &keyframePos) const
+{
+	auto keyframe =
+		std::lower_bound(positions.begin(), positions.end(), pos);
+	if (keyframe == positions.end())
+		return false;
+
+	keyframePos = *keyframe;
+	return true;
+}
+
+bool KeyframeIndex::empty() const
+{
+	return positions.empty();
+}
+
+size_t KeyframeIndex::size() const
+{
+	return positions.size();
+}
+
+void KeyframeIndex::clear()
+{
+	positions.clear();
+}
+
+/*
+ * Calls `isRandomAccess' with the first header byte(s) of each NAL unit after
+ * a 00 00 01 start code (which also matches 4-byte start codes).
+ */
+template<typename F>
+static bool anyNalUnit(const uint8_t *data, size_t size, size_t headerSize,
+		       F isRandomAccess)
+{
+	for (size_t i = 0; i + 3 + headerSize <= size; i++) {
+		if (data[i] != 0 || data[i + 1] != 0 || data[i + 2] != 1)
+			continue;
+		if (isRandomAccess(data + i + 3))
+			return true;
+		i += 2;
+	}
+	return false;
+}
+
+bool isH264Keyframe(const uint8_t *data, size_t size)
+{
+	return anyNalUnit(data, size, 1, [](const uint8_t *header) {
+		//nal_unit_type 5: coded slice of an IDR picture
+		return (header[0] & 0x1f) == 5;
+	});
+}
+
+bool isHevcKeyframe(const uint8_t *data, size_t size)
+{
+	return anyNalUnit(data, size, 2, [](const uint8_t *header) {
+		//nal_unit_type 16-23: IRAP pictures (BLA, IDR, CRA, reserved)
+		uint8_t type = (header[0] >> 1) & 0x3f;
+		return type >= 16 && type <= 23;
+	});
+}
+}
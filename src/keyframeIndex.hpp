@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+
+namespace ReplayWorkbench {
+
+/*
+ * Logical buffer positions of keyframes, in write order, so protected clip
+ * ranges can be widened to start somewhere decodable. Trimmed from the front
+ * as the buffer's tail passes.
+ */
+class KeyframeIndex {
+public:
+	void append(uint64_t pos);
+	void trim(uint64_t tailPos);
+
+	/*
+	 * Finds the last keyframe at or before `pos'. O(log n).
+	 */
+	bool previous(uint64_t pos, uint64_t &keyframePos) const;
+
+	/*
+	 * Finds the first keyframe at or after `pos'. O(log n).
+	 */
+	bool next(uint64_t pos, uint64_t &keyframePos) const;
+
+	bool empty() const;
+	size_t size() const;
+	void clear();
+
+private:
+	std::deque<uint64_t> positions;
+};
+
+/*
+ * Whether an Annex B H.264 or HEVC access unit contains a random access point
+ * (an IDR slice for H.264; any IRAP picture for HEVC), for when the encoder's
+ * packet flags are not available.
+ */
+bool isH264Keyframe(const uint8_t *data, size_t size);
+bool isHevcKeyframe(const uint8_t *data, size_t size);
+}
@@ -0,0 +1,116 @@
+#include "latencyHistogram.hpp"
+#include "coreHooks.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+namespace ReplayWorkbench {
+
+LatencyHistogram::LatencyHistogram()
+{
+	reset();
+}
+
+size_t LatencyHistogram::bucketIndex(uint64_t value)
+{
+	if (value < subBucketCount)
+		return (size_t)value;
+
+	unsigned magnitude = 63;
+	while (!(value >> magnitude))
+		magnitude--;
+	unsigned shift = magnitude - subBucketBits;
+	size_t subBucket = (size_t)(value >> shift) & (subBucketCount - 1);
+	return (shift + 1) * subBucketCount + subBucket;
+}
+
+uint64_t LatencyHistogram::bucketTop(size_t index)
+{
+	if (index < subBucketCount)
+		return index;
+
+	unsigned shift = (unsigned)(index / subBucketCount) - 1;
+	uint64_t subBucket = index % subBucketCount;
+	uint64_t bottom = (subBucketCount + subBucket) << shift;
+	return bottom + (((uint64_t)1 << shift) - 1);
+}
+
+void LatencyHistogram::record(uint64_t nanoseconds)
+{
+	buckets[bucketIndex(nanoseconds)].fetch_add(1,
+						    std::memory_order_relaxed);
+	total.fetch_add(1, std::memory_order_relaxed);
+
+	uint64_t previous = maximum.load(std::memory_order_relaxed);
+	while (nanoseconds > previous &&
+	       !maximum.compare_exchange_weak(previous, nanoseconds,
+					      std::memory_order_relaxed))
+		;
+}
+
+void LatencyHistogram::record(std::chrono::steady_clock::duration duration)
+{
+	int64_t nanoseconds =
+		std::chrono::duration_cast<std::chrono::nanoseconds>(duration)
+			.count();
+	record(nanoseconds > 0 ? (uint64_t)nanoseconds : 0);
+}
+
+uint64_t LatencyHistogram::count() const
+{
+	return total.load(std::memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::max() const
+{
+	return maximum.load(std::memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::percentile(double percentile) const
+{
+	uint64_t numRecorded = count();
+	if (numRecorded == 0)
+		return 0;
+
+	uint64_t rank = (uint64_t)std::ceil(percentile / 100.0 * numRecorded);
+	if (rank == 0)
+		rank = 1;
+
+	uint64_t seen = 0;
+	for (size_t i = 0; i < bucketCount; i++) {
+		seen += buckets[i].load(std::memory_order_relaxed);
+		if (seen >= rank)
+			return std::min(bucketTop(i), max());
+	}
+	return max();
+}
+
+void LatencyHistogram::reset()
+{
+	for (std::atomic<uint64_t> &bucket : buckets)
+		bucket.store(0, std::memory_order_relaxed);
+	total.store(0, std::memory_order_relaxed);
+	maximum.store(0, std::memory_order_relaxed);
+}
+
+void LatencyHistogram::log(const char *name) const
+{
+	coreLog(CORE_LOG_INFO,
+		"%s latency: %llu samples, p50 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f us",
+		name, (unsigned long long)count(), percentile(50) / 1000.0,
+		percentile(99) / 1000.0, percentile(99.9) / 1000.0,
+		max() / 1000.0);
+}
+
+LatencyTimer::LatencyTimer(LatencyHistogram *histogram) : histogram(histogram)
+{
+	if (histogram)
+		start = std::chrono::steady_clock::now();
+}
+
+LatencyTimer::~LatencyTimer()
+{
+	if (histogram)
+		histogram->record(std::chrono::steady_clock::now() - start);
+}
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+namespace ReplayWorkbench {
+
+/*
+ * HDR-style latency histogram: values are bucketed log-linearly, exact below
+ * 16 ns and otherwise to within 1/16 (6.25%) of their value, from nanoseconds
+ * to centuries, in fixed memory. Recording is a few relaxed atomic adds, so
+ * any thread may record while another reads percentiles; a reading taken
+ * mid-record may be off by that one value.
+ */
+class LatencyHistogram {
+public:
+	LatencyHistogram();
+	LatencyHistogram(const LatencyHistogram &) = delete;
+
+	void record(uint64_t nanoseconds);
+	void record(std::chrono::steady_clock::duration duration);
+
+	uint64_t count() const;
+	uint64_t max() const;
+
+	/*
+	 * Value at or below which `percentile' percent of recorded values
+	 * fall, rounded up to the top of its bucket; 0 if nothing has been
+	 * recorded.
+	 */
+	uint64_t percentile(double percentile) const;
+
+	void reset();
+
+	/*
+	 * Logs the count, p50, p99, p99.9 and max at info level, under
+	 * `name'.
+	 */
+	void log(const char *name) const;
+
+private:
+	static const unsigned subBucketBits = 4;
+	static const size_t subBucketCount = (size_t)1 << subBucketBits;
+	//one row of sub-buckets for the exact values, then one per power of
+	//two above them:
+	static const size_t bucketCount =
+		(64 - subBucketBits + 1) * subBucketCount;
+
+	std::atomic<uint64_t> buckets[bucketCount];
+	std::atomic<uint64_t> total;
+	std::atomic<uint64_t> maximum;
+
+	static size_t bucketIndex(uint64_t value);
+	static uint64_t bucketTop(size_t index);
+};
+
+/*
+ * Records the time from construction to destruction into a histogram, or
+ * does nothing (without reading the clock) if given NULL.
+ */
+class LatencyTimer {
+public:
+	explicit LatencyTimer(LatencyHistogram *histogram);
+	LatencyTimer(const LatencyTimer &) = delete;
+	~LatencyTimer();
+
+private:
+	LatencyHistogram *histogram;
+	std::chrono::steady_clock::time_point start;
+};
+}
@@ -17,8 +17,10 @@ with this program. If not, see <https://www.gnu.org/licenses/>
 */
 
 #include <obs-module.h>
+#include <util/bmem.h>
 
 #include "plugin-macros.generated.h"
+#include "coreHooks.hpp"
 //#include "blockCirclebuf.hpp"
 //#include "ReplayFilter.hpp"
 //#include "ClipEncoder.hpp"
@@ -30,6 +32,9 @@ struct obs_source_info filterInfo;
 
 bool obs_module_load(void)
 {
+	//route the buffer's allocations and logging through libobs:
+	ReplayWorkbench::setCoreHooks({bmalloc, bfree, blogva});
+
 	blog(LOG_INFO, "plugin loaded successfully (version %s)",
 	     PLUGIN_VERSION);
 	//	BlockCirclebuf<uint8_t> a;
@@ -0,0 +1,159 @@
+#include "streamingCopy.hpp"
+
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || \
+	defined(_M_IX86)
+#define STREAMING_COPY_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define STREAMING_COPY_TARGET(isa) __attribute__((target(isa)))
+#else
+#define STREAMING_COPY_TARGET(isa)
+#endif
+
+namespace ReplayWorkbench {
+
+typedef void (*CopyKernel)(void *dest, const void *src, size_t bytes);
+
+static void copyMemcpy(void *dest, const void *src, size_t bytes)
+{
+	memcpy(dest, src, bytes);
+}
+
+#ifdef STREAMING_COPY_X86
+/*
+ * Copies up to the first `alignment'-aligned byte of `dest' with memcpy, so
+ * the streaming loop only issues aligned stores. Returns the bytes copied.
+ */
+static size_t copyHead(void *dest, const void *src, size_t bytes,
+		       size_t alignment)
+{
+	size_t misalignment = (uintptr_t)dest & (alignment - 1);
+	size_t headBytes = misalignment ? alignment - misalignment : 0;
+	if (headBytes > bytes)
+		headBytes = bytes;
+	memcpy(dest, src, headBytes);
+	return headBytes;
+}
+
+STREAMING_COPY_TARGET("sse2")
+static void copySse2(void *dest, const void *src, size_t bytes)
+{
+	size_t done = copyHead(dest, src, bytes, 16);
+	char *out = (char *)dest + done;
+	const char *in = (const char *)src + done;
+	size_t remaining = bytes - done;
+
+	for (; remaining >= 64; remaining -= 64, in += 64, out += 64) {
+		__m128i a = _mm_loadu_si128((const __m128i *)in);
+		__m128i b = _mm_loadu_si128((const __m128i *)(in + 16));
+		__m128i c = _mm_loadu_si128((const __m128i *)(in + 32));
+		__m128i d = _mm_loadu_si128((const __m128i *)(in + 48));
+		_mm_stream_si128((__m128i *)out, a);
+		_mm_stream_si128((__m128i *)(out + 16), b);
+		_mm_stream_si128((__m128i *)(out + 32), c);
+		_mm_stream_si128((__m128i *)(out + 48), d);
+	}
+	_mm_sfence();
+	memcpy(out, in, remaining);
+}
+
+STREAMING_COPY_TARGET("avx2")
+static void copyAvx2(void *dest, const void *src, size_t bytes)
+{
+	size_t done = copyHead(dest, src, bytes, 32);
+	char *out = (char *)dest + done;
+	const char *in = (const char *)src + done;
+	size_t remaining = bytes - done;
+
+	for (; remaining >= 128; remaining -= 128, in += 128, out += 128) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)in);
+		__m256i b = _mm256_loadu_si256((const __m256i *)(in + 32));
+		__m256i c = _mm256_loadu_si256((const __m256i *)(in + 64));
+		__m256i d = _mm256_loadu_si256((const __m256i *)(in + 96));
+		_mm256_stream_si256((__m256i *)out, a);
+		_mm256_stream_si256((__m256i *)(out + 32), b);
+		_mm256_stream_si256((__m256i *)(out + 64), c);
+		_mm256_stream_si256((__m256i *)(out + 96), d);
+	}
+	_mm_sfence();
+	_mm256_zeroupper();
+	memcpy(out, in, remaining);
+}
+
+static bool cpuHasAvx2()
+{
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7)
+		return false;
+	__cpuid(info, 1);
+	//AVX2 state must also be enabled by the OS (OSXSAVE + XCR0):
+	if (!(info[2] & (1 << 27)) || (_xgetbv(0) & 0x6) != 0x6)
+		return false;
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+#endif
+}
+
+static bool cpuHasSse2()
+{
+#if defined(__x86_64__) || defined(_M_X64)
+	return true;
+#elif defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 1);
+	return (info[3] & (1 << 26)) != 0;
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse2");
+#endif
+}
+#endif
+
+static CopyKernel selectKernel(const char **name)
+{
+#ifdef STREAMING_COPY_X86
+	if (cpuHasAvx2()) {
+		*name = "avx2";
+		return copyAvx2;
+	}
+	if (cpuHasSse2()) {
+		*name = "sse2";
+		return copySse2;
+	}
+#endif
+	*name = "memcpy";
+	return copyMemcpy;
+}
+
+static const char *kernelName;
+
+static CopyKernel getKernel()
+{
+	static const CopyKernel kernel = selectKernel(&kernelName);
+	return kernel;
+}
+
+void streamingCopy(void *dest, const void *src, size_t bytes)
+{
+	getKernel()(dest, src, bytes);
+}
+
+const char *streamingCopyKernelName()
+{
+	getKernel();
+	return kernelName;
+}
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstddef>
+
+namespace ReplayWorkbench {
+
+/*
+ * Copies at or above this many bytes bypass the cache. Below it the copy is
+ * small enough that whatever it evicts costs less than the stores save.
+ */
+static const size_t streamingCopyThreshold = 256 * 1024;
+
+/*
+ * memcpy() using non-temporal stores where the CPU supports them (AVX2, else
+ * SSE2, detected at runtime), so that bulk data which will not be read again
+ * soon, such as raw frames, does not evict the working sets of other threads.
+ * Falls back to memcpy() elsewhere. The stores are fenced before returning.
+ */
+void streamingCopy(void *dest, const void *src, size_t bytes);
+
+/*
+ * Name of the kernel streamingCopy() selected, for logging.
+ */
+const char *streamingCopyKernelName();
+}
@@ -0,0 +1,163 @@
+#include "superblockMemory.hpp"
+#include "coreHooks.hpp"
+
+#include <string>
+
+#if defined(__linux__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+using namespace ReplayWorkbench;
+
+static const size_t hugePageSize = 2 * 1024 * 1024;
+
+static size_t roundUp(size_t bytes, size_t multiple)
+{
+	return (bytes + multiple - 1) / multiple * multiple;
+}
+
+#ifdef __linux__
+static bool mapHugePages(SuperblockMemory &memory, size_t bytes)
+{
+	size_t length = roundUp(bytes, hugePageSize);
+	void *start = mmap(NULL, length, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (start != MAP_FAILED) {
+		memory.start = start;
+		memory.length = length;
+		memory.mode = SuperblockMemoryMode::HUGETLB;
+		return true;
+	}
+
+	//no reserved huge pages; ask for transparent ones instead:
+	start = mmap(NULL, length, PROT_READ | PROT_WRITE,
+		     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (start == MAP_FAILED)
+		return false;
+	if (madvise(start, length, MADV_HUGEPAGE) != 0) {
+		munmap(start, length);
+		return false;
+	}
+
+	memory.start = start;
+	memory.length = length;
+	memory.mode = SuperblockMemoryMode::TRANSPARENT_HUGE_PAGES;
+	return true;
+}
+#endif
+
+#if defined(__linux__) || defined(__APPLE__)
+static bool mapFile(SuperblockMemory &memory, size_t bytes,
+		    const char *directory)
+{
+	std::string path =
+		std::string(directory) + "/replay-workbench-XXXXXX";
+	int fd = mkstemp(&path[0]);
+	if (fd < 0)
+		return false;
+
+	//the mapping keeps the file alive; unlinking now means it is cleaned
+	//up however the process exits.
+	unlink(path.c_str());
+
+	//reserve the disk space up front, so running out surfaces here rather
+	//than as SIGBUS on a later write:
+	bool sized;
+#ifdef __linux__
+	sized = posix_fallocate(fd, 0, (off_t)bytes) == 0;
+#else
+	sized = ftruncate(fd, (off_t)bytes) == 0;
+#endif
+	void *start = MAP_FAILED;
+	if (sized)
+		start = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED,
+			     fd, 0);
+	close(fd);
+	if (start == MAP_FAILED)
+		return false;
+
+	memory.start = start;
+	memory.length = bytes;
+	memory.mode = SuperblockMemoryMode::FILE;
+	return true;
+}
+#endif
+
+SuperblockMemory ReplayWorkbench::allocateSuperblockMemory(
+	size_t bytes, bool hugePages, bool lock, const char *backingDirectory)
+{
+	SuperblockMemory memory;
+	memory.start = NULL;
+	memory.length = bytes;
+	memory.mode = SuperblockMemoryMode::HEAP;
+	memory.locked = false;
+
+	if (backingDirectory && *backingDirectory) {
+#if defined(__linux__) || defined(__APPLE__)
+		if (mapFile(memory, bytes, backingDirectory)) {
+			coreLog(CORE_LOG_INFO,
+				"Allocated %zu byte superblock: file in %s",
+				memory.length, backingDirectory);
+			return memory;
+		}
+#endif
+		coreLog(CORE_LOG_WARNING,
+			"Could not back a %zu byte superblock with a file in %s, falling back to memory",
+			bytes, backingDirectory);
+	}
+
+#ifdef __linux__
+	if (hugePages && !mapHugePages(memory, bytes))
+		coreLog(CORE_LOG_WARNING,
+			"Huge pages unavailable for a %zu byte superblock, falling back to heap",
+			bytes);
+#endif
+	if (!memory.start)
+		memory.start = coreAlloc(bytes);
+
+#if defined(__linux__) || defined(__APPLE__)
+	if (lock) {
+		memory.locked = mlock(memory.start, memory.length) == 0;
+		if (!memory.locked)
+			coreLog(CORE_LOG_WARNING,
+				"Could not lock a %zu byte superblock into RAM (check RLIMIT_MEMLOCK)",
+				memory.length);
+	}
+#endif
+
+	coreLog(CORE_LOG_INFO, "Allocated %zu byte superblock: %s%s",
+		memory.length, superblockMemoryModeName(memory.mode),
+		memory.locked ? ", locked" : "");
+	return memory;
+}
+
+void ReplayWorkbench::freeSuperblockMemory(SuperblockMemory &memory)
+{
+#if defined(__linux__) || defined(__APPLE__)
+	if (memory.locked)
+		munlock(memory.start, memory.length);
+	if (memory.mode != SuperblockMemoryMode::HEAP) {
+		munmap(memory.start, memory.length);
+		memory.start = NULL;
+		return;
+	}
+#endif
+	coreFree(memory.start);
+	memory.start = NULL;
+}
+
+const char *ReplayWorkbench::superblockMemoryModeName(SuperblockMemoryMode mode)
+{
+	switch (mode) {
+	case SuperblockMemoryMode::HUGETLB:
+		return "hugetlb";
+	case SuperblockMemoryMode::TRANSPARENT_HUGE_PAGES:
+		return "transparent huge pages";
+	case SuperblockMemoryMode::FILE:
+		return "file";
+	default:
+		return "heap";
+	}
+}
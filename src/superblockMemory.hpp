@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstddef>
+
+namespace ReplayWorkbench {
+
+/*
+ * How the memory behind a superblock was actually obtained. Requested modes
+ * fall back towards HEAP when the system does not support them.
+ */
+enum class SuperblockMemoryMode {
+	//regular allocation through the core allocator hook:
+	HEAP,
+	//anonymous mapping backed by explicitly reserved huge pages
+	//(MAP_HUGETLB):
+	HUGETLB,
+	//anonymous mapping marked for transparent huge pages (MADV_HUGEPAGE):
+	TRANSPARENT_HUGE_PAGES,
+	//shared mapping of an unlinked file, so the page cache and kernel
+	//writeback hold the data rather than anonymous memory:
+	FILE
+};
+
+struct SuperblockMemory {
+	void *start;
+	//bytes allocated, which may be rounded up from the request:
+	size_t length;
+	SuperblockMemoryMode mode;
+	//whether the memory is locked into RAM (mlock):
+	bool locked;
+};
+
+/*
+ * Allocates `bytes' of superblock memory. If `backingDirectory' is non-empty
+ * the memory is a mapping of a temporary file created there, allowing buffers
+ * far larger than RAM; otherwise huge pages are preferred if requested, and
+ * the memory is optionally locked into RAM. Never fails over a mode the
+ * system does not support; check the returned mode to see what took effect.
+ */
+SuperblockMemory allocateSuperblockMemory(size_t bytes, bool hugePages,
+					  bool lock,
+					  const char *backingDirectory);
+void freeSuperblockMemory(SuperblockMemory &memory);
+const char *superblockMemoryModeName(SuperblockMemoryMode mode);
+}
@@ -0,0 +1,58 @@
+#include "timestampIndex.hpp"
+
+#include <algorithm>
+
+namespace ReplayWorkbench {
+
+void TimestampIndex::append(int64_t timestamp, uint64_t pos)
+{
+	if (!entries.empty() && timestamp < entries.back().timestamp)
+		timestamp = entries.back().timestamp;
+	entries.push_back({timestamp, pos});
+}
+
+void TimestampIndex::trim(uint64_t tailPos)
+{
+	while (!entries.empty() && entries.front().pos < tailPos)
+		entries.pop_front();
+}
+
+bool TimestampIndex::lookup(int64_t timestamp, uint64_t &pos) const
+{
+	auto entry = std::lower_bound(
+		entries.begin(), entries.end(), timestamp,
+		[](const Entry &entry, int64_t timestamp) {
+			return entry.timestamp < timestamp;
+		});
+	if (entry == entries.end())
+		return false;
+
+	pos = entry->pos;
+	return true;
+}
+
+bool TimestampIndex::empty() const
+{
+	return entries.empty();
+}
+
+size_t TimestampIndex::size() const
+{
+	return entries.size();
+}
+
+const TimestampIndex::Entry &TimestampIndex::front() const
+{
+	return entries.front();
+}
+
+const TimestampIndex::Entry &TimestampIndex::back() const
+{
+	return entries.back();
+}
+
+void TimestampIndex::clear()
+{
+	entries.clear();
+}
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+
+namespace ReplayWorkbench {
+
+/*
+ * Maps presentation timestamps to logical buffer positions, so a clip of "the
+ * last N seconds" can be found without scanning the buffer. Entries are
+ * appended in write order and dropped from the front as the buffer's tail
+ * passes them. Timestamps need not be monotonic (e.g. video with B-frames):
+ * each entry is keyed by the highest timestamp seen up to it, so lookups land
+ * on the first record by which a given time had been reached.
+ */
+class TimestampIndex {
+public:
+	struct Entry {
+		int64_t timestamp;
+		uint64_t pos;
+	};
+
+	void append(int64_t timestamp, uint64_t pos);
+
+	/*
+	 * Drops entries for records starting before `tailPos', which the
+	 * buffer no longer holds in full.
+	 */
+	void trim(uint64_t tailPos);
+
+	/*
+	 * Finds the position of the first record at or after `timestamp'.
+	 * Returns false if nothing indexed is that late. O(log n).
+	 */
+	bool lookup(int64_t timestamp, uint64_t &pos) const;
+
+	bool empty() const;
+	size_t size() const;
+	const Entry &front() const;
+	const Entry &back() const;
+	void clear();
+
+private:
+	std::deque<Entry> entries;
+};
+}
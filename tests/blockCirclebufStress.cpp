@@ -0,0 +1,208 @@
+/*
+ * Randomised test of BlockCirclebuf: each seed picks a configuration, then
+ * runs a few thousand random writes, reservations, reads, readers,
+ * protections, snapshots and maintenance calls against it. Every element
+ * written holds its own logical position, so after each step the live
+ * stream, every protection and snapshot, and everything readers return can
+ * be checked against where it claims to come from. In concurrent mode,
+ * where readers are unavailable, everything read must also follow on from
+ * the last read, as nothing unread may be evicted. Usage:
+ *
+ *	blockCirclebufStress [first seed] [last seed] [concurrent]
+ */
+#include "blockCirclebuf.hpp"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+using namespace ReplayWorkbench;
+
+typedef BlockCirclebuf<uint32_t> Buffer;
+
+static const int steps = 3000;
+
+static unsigned seed;
+static int step;
+static bool concurrent;
+
+#define CHECK(condition)                                                  \
+	do {                                                              \
+		if (!(condition)) {                                       \
+			fprintf(stderr,                                   \
+				"seed %u step %d: check failed: %s\n",    \
+				seed, step, #condition);                  \
+			exit(1);                                          \
+		}                                                         \
+	} while (0)
+
+struct Protected {
+	Buffer::Protection *protection;
+	uint64_t begin;
+	uint64_t end;
+};
+
+static void run(std::mt19937 &rng)
+{
+	auto random = [&](size_t n) { return n > 0 ? rng() % n : 0; };
+
+	Buffer::Config config;
+	config.concurrent = concurrent;
+	config.blockCount = (concurrent ? 2 : 1) + random(6);
+	size_t size = config.blockCount * (4 + random(20));
+	if (random(2)) {
+		config.growthSize = 8 + random(32);
+		config.maxSize = size + config.growthSize * random(4);
+		config.growthThreshold = random(size / 2);
+	}
+	config.overflowPolicy = random(2) ? Buffer::OverflowPolicy::REJECT
+					  : Buffer::OverflowPolicy::DROP;
+	config.deferReconcile = random(2);
+	Buffer buffer(size, config);
+
+	uint64_t written = 0;
+	uint64_t readEnd = 0;
+	std::vector<Protected> protections;
+	std::vector<Buffer::Reader *> readers;
+	std::vector<Buffer::Snapshot *> snapshots;
+	std::vector<Buffer::Span> spans;
+	std::vector<uint32_t> data(64);
+
+	for (step = 0; step < steps; step++) {
+		size_t op = random(100);
+		if (op < 35) {
+			size_t count = random(40);
+			for (size_t i = 0; i < count; i++)
+				data[i] = (uint32_t)(written + i);
+			buffer.write(data.data(), count);
+		} else if (op < 45) {
+			size_t reserved = buffer.reserve(spans, random(40));
+			size_t count = random(reserved + 1);
+			uint64_t pos = written;
+			size_t left = count;
+			for (const Buffer::Span &span : spans)
+				for (size_t i = 0; i < span.length && left > 0;
+				     i++, left--)
+					span.ptr[i] = (uint32_t)pos++;
+			buffer.commit(count);
+		} else if (op < 60) {
+			size_t count =
+				buffer.read(data.data(), random(data.size()));
+			for (size_t i = 0; i < count; i++)
+				CHECK(data[i] == data[0] + i);
+			if (count > 0) {
+				CHECK(data[0] >= readEnd);
+				CHECK(!concurrent || data[0] == readEnd);
+				readEnd = data[0] + count;
+			}
+		} else if (op < 68) {
+			if (concurrent) {
+				//no readers in this mode
+			} else if (readers.size() < 3) {
+				readers.push_back(buffer.addReader(
+					random(2) ? Buffer::ReaderPolicy::RETAIN
+						  : Buffer::ReaderPolicy::OVERRUN));
+			} else {
+				buffer.removeReader(readers.back());
+				readers.pop_back();
+			}
+		} else if (op < 80) {
+			if (!readers.empty()) {
+				Buffer::Reader *reader =
+					readers[random(readers.size())];
+				uint64_t pos = reader->getPos();
+				size_t count = buffer.read(reader, data.data(),
+							   random(data.size()));
+				for (size_t i = 0; i < count; i++)
+					CHECK(data[i] == (uint32_t)(pos + i));
+			}
+		} else if (op < 88) {
+			uint64_t health = buffer.bufferHealth();
+			if (health > 0 && protections.size() < 4) {
+				uint64_t begin = written - health + random(health);
+				uint64_t end = begin + random(written - begin + 1);
+				protections.push_back(
+					{buffer.protect(buffer.ptrAt(begin),
+							buffer.ptrAt(end)),
+					 begin, end});
+			}
+		} else if (op < 94) {
+			if (!protections.empty()) {
+				size_t i = random(protections.size());
+				buffer.unprotect(protections[i].protection);
+				protections.erase(protections.begin() + i);
+			}
+		} else if (op < 97) {
+			buffer.coalesce();
+			buffer.reclaim();
+		} else {
+			uint64_t health = buffer.bufferHealth();
+			if (health > 0 && snapshots.size() < 2) {
+				uint64_t begin = written - health + random(health);
+				uint64_t end = begin + random(written - begin + 1);
+				snapshots.push_back(buffer.snapshot(
+					buffer.ptrAt(begin), buffer.ptrAt(end),
+					random(2)));
+			} else if (!snapshots.empty()) {
+				buffer.releaseSnapshot(snapshots.back());
+				snapshots.pop_back();
+			}
+		}
+		written = buffer.stats().bytesWritten / sizeof(uint32_t);
+		if (concurrent)
+			CHECK(buffer.stats().bytesEvicted == 0);
+
+		for (const Protected &p : protections) {
+			for (uint64_t pos = p.begin; pos < p.end;
+			     pos += 1 + random(5)) {
+				uint32_t value;
+				if (buffer.readProtected(p.protection, pos,
+							 &value, 1) == 1)
+					CHECK(value == (uint32_t)pos);
+			}
+		}
+		for (Buffer::Snapshot *snapshot : snapshots) {
+			for (uint64_t pos = snapshot->getBegin();
+			     pos < snapshot->getEnd(); pos += 1 + random(5)) {
+				uint32_t value;
+				CHECK(snapshot->read(pos, &value, 1) == 1);
+				CHECK(value == (uint32_t)pos);
+			}
+		}
+
+		//the tail cannot be read past a RETAIN reader, so the live
+		//stream may not all be readable:
+		size_t health = buffer.bufferHealth();
+		CHECK(health <= written);
+		CHECK(buffer.peek(spans, health) <= health);
+		uint64_t pos = written - health;
+		for (const Buffer::Span &span : spans)
+			for (size_t i = 0; i < span.length; i++, pos++)
+				CHECK(span.ptr[i] == (uint32_t)pos);
+	}
+
+	for (Buffer::Snapshot *snapshot : snapshots)
+		buffer.releaseSnapshot(snapshot);
+	for (const Protected &p : protections)
+		buffer.unprotect(p.protection);
+	for (Buffer::Reader *reader : readers)
+		buffer.removeReader(reader);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned first = argc > 1 ? strtoul(argv[1], NULL, 10) : 1;
+	unsigned last = argc > 2 ? strtoul(argv[2], NULL, 10) : first;
+	concurrent = argc > 3 && strcmp(argv[3], "concurrent") == 0;
+
+	for (seed = first; seed <= last; seed++) {
+		std::mt19937 rng(seed);
+		run(rng);
+	}
+	printf("seeds %u to %u passed%s\n", first, last,
+	       concurrent ? " in concurrent mode" : "");
+	return 0;
+}
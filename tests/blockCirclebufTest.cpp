@@ -0,0 +1,770 @@
+/*
+ * Regression tests for BlockCirclebuf, one case per run so ctest can report
+ * them separately. Every element written holds its own logical position, so
+ * any data the buffer hands back can be checked against where it claims to
+ * come from. Usage:
+ *
+ *	blockCirclebufTest <case>
+ */
+#include "blockCirclebuf.hpp"
+#include "blockCompression.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace ReplayWorkbench;
+
+typedef BlockCirclebuf<uint32_t> Buffer;
+
+#define CHECK(condition)                                                \
+	do {                                                            \
+		if (!(condition)) {                                     \
+			fprintf(stderr, "%s:%d: check failed: %s\n",    \
+				__FILE__, __LINE__, #condition);        \
+			exit(1);                                        \
+		}                                                       \
+	} while (0)
+
+static uint64_t written(Buffer &buffer)
+{
+	return buffer.stats().bytesWritten / sizeof(uint32_t);
+}
+
+static std::vector<uint32_t> positions(uint64_t from, size_t count)
+{
+	std::vector<uint32_t> data(count);
+	for (size_t i = 0; i < count; i++)
+		data[i] = (uint32_t)(from + i);
+	return data;
+}
+
+static Buffer::WriteStatus writeNext(Buffer &buffer, size_t count)
+{
+	std::vector<uint32_t> data = positions(written(buffer), count);
+	return buffer.write(data.data(), count);
+}
+
+/*
+ * Checks that the live stream, from the tail up to the head, holds
+ * consecutive positions ending at the last one written. The tail cannot be
+ * read past a RETAIN reader, so any must have caught up first.
+ */
+static void checkLive(Buffer &buffer)
+{
+	std::vector<Buffer::Span> spans;
+	size_t health = buffer.bufferHealth();
+	CHECK(health <= written(buffer));
+	CHECK(buffer.peek(spans, health) == health);
+	uint64_t pos = written(buffer) - health;
+	for (const Buffer::Span &span : spans)
+		for (size_t i = 0; i < span.length; i++, pos++)
+			CHECK(span.ptr[i] == (uint32_t)pos);
+	CHECK(pos == written(buffer));
+}
+
+/*
+ * Reads everything `reader' has left, checking it continues from where the
+ * reader was.
+ */
+static size_t checkReader(Buffer &buffer, Buffer::Reader *reader)
+{
+	uint64_t pos = reader->getPos();
+	std::vector<uint32_t> out(buffer.readerLag(reader) + 1);
+	size_t count = buffer.read(reader, out.data(), out.size());
+	for (size_t i = 0; i < count; i++)
+		CHECK(out[i] == (uint32_t)(pos + i));
+	CHECK(reader->getPos() == pos + count);
+	return count;
+}
+
+/*
+ * A RETAIN reader that has read nothing, and a protection over most of the
+ * rest, leave no room: reserve() must grow the buffer and commit() publish
+ * exactly the elements reserve() handed out, in order, for the reader.
+ */
+static void reserveCommitGrowthRetain()
+{
+	Buffer::Config config;
+	config.blockCount = 4;
+	config.growthSize = 32;
+	config.maxSize = 1024;
+	Buffer buffer(64, config);
+	Buffer::Reader *reader = buffer.addReader(Buffer::ReaderPolicy::RETAIN);
+	Buffer::Reader *follower =
+		buffer.addReader(Buffer::ReaderPolicy::OVERRUN);
+
+	CHECK(writeNext(buffer, 64) == Buffer::WriteStatus::OK);
+	Buffer::Protection *protection =
+		buffer.protect(buffer.ptrAt(0), buffer.ptrAt(48));
+
+	std::vector<Buffer::Span> spans;
+	for (size_t round = 0; round < 16; round++) {
+		size_t count = 5 + round * 3;
+		CHECK(buffer.reserve(spans, count) == count);
+		uint64_t pos = written(buffer);
+		for (const Buffer::Span &span : spans)
+			for (size_t i = 0; i < span.length; i++)
+				span.ptr[i] = (uint32_t)pos++;
+		buffer.commit(count);
+		CHECK(written(buffer) == pos);
+		checkReader(buffer, follower);
+	}
+	CHECK(buffer.getSuperblocks().size() > 1);
+
+	CHECK(checkReader(buffer, reader) == written(buffer));
+	checkLive(buffer);
+	buffer.unprotect(protection);
+	CHECK(writeNext(buffer, 40) == Buffer::WriteStatus::OK);
+	CHECK(checkReader(buffer, reader) == 40);
+	checkLive(buffer);
+	buffer.removeReader(follower);
+	buffer.removeReader(reader);
+}
+
+/*
+ * Protecting the block the head is in, then releasing it again, must give
+ * that space back to the writer without losing or reordering anything, even
+ * with an empty reservation in between.
+ */
+static void protectUnprotectReuse()
+{
+	Buffer::Config config;
+	config.blockCount = 4;
+	Buffer buffer(64, config);
+	CHECK(writeNext(buffer, 64) == Buffer::WriteStatus::OK);
+
+	//the head, at the end of a full ring, is about to wrap onto the
+	//protected block:
+	std::vector<Buffer::Span> spans;
+	Buffer::Protection *oldest =
+		buffer.protect(buffer.ptrAt(0), buffer.ptrAt(16));
+	CHECK(buffer.stats().protectedBytes == 16 * sizeof(uint32_t));
+	CHECK(buffer.stats().largestFreeSpan == 48 * sizeof(uint32_t));
+	buffer.reserve(spans, 1);
+	buffer.commit(0);
+	buffer.unprotect(oldest);
+	CHECK(buffer.stats().protectedBytes == 0);
+	CHECK(buffer.stats().largestFreeSpan == 64 * sizeof(uint32_t));
+	CHECK(writeNext(buffer, 8) == Buffer::WriteStatus::OK);
+	CHECK(writeNext(buffer, 8) == Buffer::WriteStatus::OK);
+	checkLive(buffer);
+
+	//and from wherever the head is, protecting data just behind it:
+	for (size_t round = 0; round < 64; round++) {
+		uint64_t head = written(buffer);
+		uint64_t tail = head - buffer.bufferHealth();
+		uint64_t begin = head - (round % 16 + 1);
+		if (begin < tail)
+			begin = tail;
+		Buffer::Protection *protection =
+			buffer.protect(buffer.ptrAt(begin), buffer.ptrAt(head));
+		buffer.reserve(spans, 1 + round % 3);
+		buffer.commit(0);
+		checkLive(buffer);
+		buffer.unprotect(protection);
+
+		CHECK(writeNext(buffer, 8) == Buffer::WriteStatus::OK);
+		CHECK(writeNext(buffer, 8) == Buffer::WriteStatus::OK);
+		checkLive(buffer);
+	}
+
+	std::vector<uint32_t> out(64);
+	uint64_t pos = written(buffer) - buffer.bufferHealth();
+	size_t count = buffer.read(out.data(), out.size());
+	CHECK(count > 0);
+	for (size_t i = 0; i < count; i++)
+		CHECK(out[i] == (uint32_t)(pos + i));
+
+	//a BCPtr the head has since lapped is turned away:
+	Buffer::BCPtr stale = buffer.ptrAt(written(buffer));
+	CHECK(writeNext(buffer, 64) == Buffer::WriteStatus::OK);
+	CHECK(writeNext(buffer, 1) == Buffer::WriteStatus::OK);
+	bool thrown = false;
+	try {
+		buffer.protect(stale, buffer.ptrAt(written(buffer)));
+	} catch (const std::out_of_range &) {
+		thrown = true;
+	}
+	CHECK(thrown);
+	checkLive(buffer);
+}
+
+/*
+ * With every block but the one being written protected, readers have
+ * nothing to skip to. Reads must return rather than search the ring for
+ * ever, and carry on once the protection is gone.
+ */
+static void readersAllExcluded()
+{
+	Buffer::Config config;
+	config.blockCount = 2;
+	Buffer buffer(64, config);
+	Buffer::Reader *overrun =
+		buffer.addReader(Buffer::ReaderPolicy::OVERRUN);
+
+	CHECK(writeNext(buffer, 64) == Buffer::WriteStatus::OK);
+	Buffer::Protection *protection =
+		buffer.protect(buffer.ptrAt(0), buffer.ptrAt(64));
+	writeNext(buffer, 1);
+	CHECK(buffer.bufferHealth() <= 1);
+	CHECK(buffer.readerLag(overrun) <= 1);
+	checkReader(buffer, overrun);
+	checkLive(buffer);
+
+	std::vector<uint32_t> out(8);
+	buffer.read(out.data(), out.size());
+	CHECK(buffer.bufferHealth() == 0);
+
+	buffer.unprotect(protection);
+	CHECK(writeNext(buffer, 40) == Buffer::WriteStatus::OK);
+	checkLive(buffer);
+	CHECK(checkReader(buffer, overrun) == 40);
+	buffer.removeReader(overrun);
+}
+
+/*
+ * Records the buffer has no room for are not indexed, whichever overflow
+ * policy turned them away, and writev() reports where each record it wrote
+ * starts.
+ */
+static void overflowIndex(Buffer::OverflowPolicy policy)
+{
+	Buffer::Config config;
+	config.blockCount = 4;
+	config.overflowPolicy = policy;
+	Buffer::WriteStatus refused = policy == Buffer::OverflowPolicy::REJECT
+					      ? Buffer::WriteStatus::REJECTED
+					      : Buffer::WriteStatus::DROPPED;
+	std::vector<uint64_t> recordPositions;
+	std::vector<Buffer::Span> records;
+	uint64_t pos;
+
+	{
+		Buffer buffer(64, config);
+		for (int i = 0; i < 4; i++) {
+			std::vector<uint32_t> data =
+				positions(written(buffer), 16);
+			CHECK(buffer.write(data.data(), 16, i, i == 0) ==
+			      Buffer::WriteStatus::OK);
+		}
+		CHECK(buffer.getTimestampIndex().size() == 4);
+		CHECK(buffer.getKeyframeIndex().size() == 1);
+
+		//nothing is left writable:
+		Buffer::Protection *protection =
+			buffer.protect(buffer.ptrAt(0), buffer.ptrAt(64));
+		std::vector<uint32_t> data = positions(written(buffer), 4);
+		CHECK(buffer.write(data.data(), 4, 100, true) == refused);
+		CHECK(!buffer.positionAt(100, pos));
+		CHECK(!buffer.getKeyframeIndex().next(64, pos));
+
+		records.push_back({data.data(), 4});
+		CHECK(buffer.writev(records, recordPositions) == 0);
+		CHECK(recordPositions.empty());
+		CHECK(written(buffer) == 64);
+
+		buffer.unprotect(protection);
+		data = positions(written(buffer), 16);
+		CHECK(buffer.write(data.data(), 16, 200, true) ==
+		      Buffer::WriteStatus::OK);
+		CHECK(buffer.positionAt(200, pos));
+		CHECK(pos == 64);
+		CHECK(buffer.getKeyframeIndex().next(64, pos));
+		checkLive(buffer);
+	}
+
+	{
+		//three records of 6 with room for 16:
+		Buffer buffer(64, config);
+		CHECK(writeNext(buffer, 64) == Buffer::WriteStatus::OK);
+		Buffer::Protection *protection =
+			buffer.protect(buffer.ptrAt(16), buffer.ptrAt(64));
+		std::vector<uint32_t> batch = positions(64, 18);
+		records.clear();
+		for (size_t i = 0; i < 3; i++)
+			records.push_back({batch.data() + i * 6, 6});
+		size_t count = buffer.writev(records, recordPositions);
+		CHECK(count == recordPositions.size());
+		if (policy == Buffer::OverflowPolicy::REJECT)
+			CHECK(count == 2);
+		for (size_t i = 0; i < count; i++)
+			CHECK(recordPositions[i] == 64 + i * 6);
+		CHECK(written(buffer) == 64 + count * 6);
+		checkLive(buffer);
+		buffer.unprotect(protection);
+	}
+}
+
+static void overflowIndex()
+{
+	overflowIndex(Buffer::OverflowPolicy::DROP);
+	overflowIndex(Buffer::OverflowPolicy::REJECT);
+}
+
+/*
+ * A lease holds its data like any protection until it runs out, unless
+ * renewed; then the writer takes the space back, and the handle only reports
+ * the expiry until it is unprotected.
+ */
+static void leases()
+{
+	Buffer::Config config;
+	config.blockCount = 4;
+	config.overflowPolicy = Buffer::OverflowPolicy::REJECT;
+	Buffer buffer(64, config);
+	CHECK(writeNext(buffer, 64) == Buffer::WriteStatus::OK);
+
+	Buffer::Protection *lease = buffer.protect(
+		buffer.ptrAt(0), buffer.ptrAt(48), std::chrono::hours(1));
+	CHECK(writeNext(buffer, 32) == Buffer::WriteStatus::REJECTED);
+	CHECK(!lease->isExpired());
+
+	std::vector<uint32_t> out(48);
+	CHECK(buffer.readProtected(lease, 0, out.data(), 48) == 48);
+	for (size_t i = 0; i < out.size(); i++)
+		CHECK(out[i] == (uint32_t)i);
+
+	//cut short, then kept alive past its first expiry by a renewal:
+	CHECK(buffer.renew(lease, std::chrono::milliseconds(20)));
+	CHECK(buffer.renew(lease, std::chrono::milliseconds(200)));
+	std::this_thread::sleep_for(std::chrono::milliseconds(40));
+	CHECK(writeNext(buffer, 32) == Buffer::WriteStatus::REJECTED);
+	CHECK(!lease->isExpired());
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(200));
+	CHECK(writeNext(buffer, 32) == Buffer::WriteStatus::OK);
+	CHECK(lease->isExpired());
+	CHECK(buffer.readProtected(lease, 0, out.data(), 48) == 0);
+	CHECK(!buffer.renew(lease, std::chrono::hours(1)));
+	CHECK(buffer.stats().protectedBytes == 0);
+	buffer.unprotect(lease);
+
+	CHECK(writeNext(buffer, 64) == Buffer::WriteStatus::OK);
+	checkLive(buffer);
+}
+
+/*
+ * With room for only part of a write, DROP carries on round what is left,
+ * keeping the newest data, and discards the write only once nothing at all is
+ * writable; REJECT writes nothing, and turns away a write larger than the
+ * whole buffer without evicting anything.
+ */
+static void overflowPolicies()
+{
+	Buffer::Config config;
+	config.blockCount = 4;
+
+	{
+		Buffer buffer(64, config);
+		CHECK(writeNext(buffer, 64) == Buffer::WriteStatus::OK);
+		Buffer::Protection *protection =
+			buffer.protect(buffer.ptrAt(16), buffer.ptrAt(64));
+		CHECK(writeNext(buffer, 24) == Buffer::WriteStatus::OK);
+		CHECK(written(buffer) == 88);
+		CHECK(buffer.bufferHealth() == 16);
+		checkLive(buffer);
+		buffer.unprotect(protection);
+
+		CHECK(writeNext(buffer, 64) == Buffer::WriteStatus::OK);
+		protection = buffer.protect(buffer.ptrAt(written(buffer) - 64),
+					    buffer.ptrAt(written(buffer)));
+		CHECK(writeNext(buffer, 8) == Buffer::WriteStatus::DROPPED);
+		CHECK(written(buffer) == 152);
+		buffer.unprotect(protection);
+		CHECK(writeNext(buffer, 8) == Buffer::WriteStatus::OK);
+		checkLive(buffer);
+	}
+
+	config.overflowPolicy = Buffer::OverflowPolicy::REJECT;
+	{
+		Buffer buffer(64, config);
+		CHECK(writeNext(buffer, 64) == Buffer::WriteStatus::OK);
+		Buffer::Protection *protection =
+			buffer.protect(buffer.ptrAt(16), buffer.ptrAt(64));
+		CHECK(writeNext(buffer, 24) == Buffer::WriteStatus::REJECTED);
+		CHECK(written(buffer) == 64);
+		CHECK(writeNext(buffer, 16) == Buffer::WriteStatus::OK);
+		checkLive(buffer);
+		buffer.unprotect(protection);
+
+		uint64_t health = buffer.bufferHealth();
+		CHECK(writeNext(buffer, 100) == Buffer::WriteStatus::REJECTED);
+		CHECK(written(buffer) == 80);
+		CHECK(buffer.bufferHealth() == health);
+		CHECK(buffer.stats().bytesEvicted == 16 * sizeof(uint32_t));
+		checkLive(buffer);
+
+		//and writev() stops at the record that could never fit,
+		//evicting only for those before it:
+		std::vector<uint32_t> batch = positions(80, 116);
+		std::vector<Buffer::Span> records = {{batch.data(), 8},
+						     {batch.data() + 8, 100},
+						     {batch.data() + 108, 8}};
+		std::vector<uint64_t> recordPositions;
+		CHECK(buffer.writev(records, recordPositions) == 1);
+		CHECK(recordPositions.size() == 1 && recordPositions[0] == 80);
+		CHECK(written(buffer) == 88);
+		CHECK(buffer.stats().bytesEvicted == 24 * sizeof(uint32_t));
+		checkLive(buffer);
+	}
+}
+
+/*
+ * A compressed protection reads back what was protected, from anywhere in its
+ * range, after the writer has reused its blocks. Without a codec compress()
+ * refuses, and the range stays protected in place instead.
+ */
+static void compressProtected()
+{
+	Buffer::Config config;
+	config.blockCount = 4;
+	Buffer buffer(256, config);
+	CHECK(writeNext(buffer, 256) == Buffer::WriteStatus::OK);
+	Buffer::Protection *protection =
+		buffer.protect(buffer.ptrAt(32), buffer.ptrAt(160));
+
+	bool compressed = buffer.compress(protection);
+	CHECK(compressed == compressionAvailable());
+	CHECK(protection->isCompressed() == compressed);
+	if (compressed) {
+		CHECK(protection->getCompressedSize() > 0);
+		CHECK(protection->getCompressedSize() <
+		      128 * sizeof(uint32_t));
+		CHECK(buffer.stats().protectedBytes == 0);
+	} else {
+		CHECK(buffer.stats().protectedBytes == 128 * sizeof(uint32_t));
+	}
+	CHECK(!buffer.compress(protection));
+
+	for (int i = 0; i < 8; i++)
+		CHECK(writeNext(buffer, 64) == Buffer::WriteStatus::OK);
+	checkLive(buffer);
+
+	std::vector<uint32_t> out(128);
+	CHECK(buffer.readProtected(protection, 32, out.data(), 200) == 128);
+	for (size_t i = 0; i < out.size(); i++)
+		CHECK(out[i] == (uint32_t)(32 + i));
+	CHECK(buffer.readProtected(protection, 100, out.data(), 10) == 10);
+	for (size_t i = 0; i < 10; i++)
+		CHECK(out[i] == (uint32_t)(100 + i));
+	CHECK(buffer.readProtected(protection, 160, out.data(), 1) == 0);
+	buffer.unprotect(protection);
+}
+
+/*
+ * Element that owns heap memory and counts how many of it are alive, so
+ * elements the buffer fails to construct, destroy or move show up.
+ */
+struct Tracked {
+	static long live;
+	std::string value;
+
+	Tracked() { live++; }
+	Tracked(const std::string &value) : value(value) { live++; }
+	Tracked(const Tracked &other) : value(other.value) { live++; }
+	Tracked(Tracked &&other) : value(std::move(other.value)) { live++; }
+	Tracked &operator=(const Tracked &other) = default;
+	~Tracked() { live--; }
+};
+
+long Tracked::live;
+
+static std::string trackedValue(uint64_t pos)
+{
+	//too long to be stored inline, so every element owns an allocation:
+	return "element at position " + std::to_string(pos);
+}
+
+/*
+ * A buffer of a type that is not trivially copyable moves each element in,
+ * copies it out to every reader, snapshot and protection that asks, and
+ * destroys every element it constructed, growth included, once it is gone.
+ */
+static void nonTrivialElements()
+{
+	typedef BlockCirclebuf<Tracked> TrackedBuffer;
+	TrackedBuffer::Config config;
+	config.blockCount = 4;
+	config.growthSize = 32;
+	config.maxSize = 256;
+	config.growthThreshold = 48;
+
+	{
+		TrackedBuffer buffer(64, config);
+		TrackedBuffer::Reader *reader =
+			buffer.addReader(TrackedBuffer::ReaderPolicy::RETAIN);
+		uint64_t pos = 0;
+		auto writeTracked = [&](size_t count) {
+			std::vector<Tracked> data;
+			for (size_t i = 0; i < count; i++)
+				data.emplace_back(trackedValue(pos + i));
+			CHECK(buffer.write(data.data(), count) ==
+			      TrackedBuffer::WriteStatus::OK);
+			for (const Tracked &element : data)
+				CHECK(element.value.empty());
+			pos += count;
+		};
+
+		auto readAll = [&]() {
+			std::vector<Tracked> out(buffer.readerLag(reader));
+			uint64_t from = reader->getPos();
+			CHECK(buffer.read(reader, out.data(), out.size()) ==
+			      out.size());
+			for (size_t i = 0; i < out.size(); i++)
+				CHECK(out[i].value == trackedValue(from + i));
+		};
+
+		writeTracked(64);
+		readAll();
+		TrackedBuffer::Protection *protection =
+			buffer.protect(buffer.ptrAt(8), buffer.ptrAt(40));
+		TrackedBuffer::Snapshot *snapshot =
+			buffer.snapshot(buffer.ptrAt(40), buffer.ptrAt(64));
+		//the protection leaves too little room, so the buffer grows:
+		for (int i = 0; i < 6; i++) {
+			writeTracked(16);
+			readAll();
+		}
+		CHECK(buffer.getSuperblocks().size() > 1);
+
+		std::vector<Tracked> out(32);
+		CHECK(buffer.readProtected(protection, 8, out.data(), 32) ==
+		      32);
+		for (size_t i = 0; i < 32; i++)
+			CHECK(out[i].value == trackedValue(8 + i));
+		CHECK(snapshot->read(40, out.data(), 24) == 24);
+		for (size_t i = 0; i < 24; i++)
+			CHECK(out[i].value == trackedValue(40 + i));
+
+		buffer.releaseSnapshot(snapshot);
+		buffer.unprotect(protection);
+		buffer.removeReader(reader);
+		for (int i = 0; i < 16; i++)
+			writeTracked(16);
+		buffer.reclaim();
+		CHECK(buffer.getSuperblocks().size() == 1);
+	}
+	CHECK(Tracked::live == 0);
+}
+
+static size_t liveAllocations;
+static size_t allocatorCalls;
+
+static void *countedAllocate(size_t bytes)
+{
+	liveAllocations++;
+	allocatorCalls++;
+	return malloc(bytes);
+}
+
+static void countedRelease(void *ptr)
+{
+	if (ptr)
+		liveAllocations--;
+	allocatorCalls++;
+	free(ptr);
+}
+
+static void quietLog(int level, const char *format, va_list args)
+{
+	if (level <= CORE_LOG_WARNING)
+		vfprintf(stderr, format, args);
+}
+
+/*
+ * Grows the buffer under a protection and reclaims the growth once it is
+ * released, over and over: memory in use, superblocks and block
+ * descriptors alike, must level off rather than climb with every cycle. The
+ * growth is set aside ahead of time, so the writer itself must neither
+ * allocate nor free anything growing and shrinking.
+ */
+static void growReclaimMemory()
+{
+	CoreHooks hooks = {countedAllocate, countedRelease, quietLog};
+	setCoreHooks(hooks);
+
+	Buffer::Config config;
+	config.growthSize = 16 * 1024;
+	config.maxSize = 64 * 1024;
+	config.growthThreshold = 8 * 1024;
+	size_t superblocks = 0;
+	size_t allocations = 0;
+	{
+		Buffer buffer(16 * 1024, config);
+		for (size_t cycle = 0; cycle < 300; cycle++) {
+			size_t calls = allocatorCalls;
+			for (int i = 0; i < 16; i++)
+				writeNext(buffer, 1024);
+			Buffer::Protection *protection = buffer.protectRange(
+				written(buffer) - 12 * 1024, written(buffer));
+			for (int i = 0; i < 16; i++)
+				writeNext(buffer, 1024);
+			buffer.unprotect(protection);
+			for (int i = 0; i < 40; i++)
+				writeNext(buffer, 1024);
+			CHECK(allocatorCalls == calls);
+			buffer.reclaim();
+			checkLive(buffer);
+
+			//the first few cycles set the bounds:
+			if (cycle < 10) {
+				superblocks = std::max(
+					superblocks, buffer.getSuperblocks().size());
+				allocations =
+					std::max(allocations, liveAllocations);
+			}
+			CHECK(buffer.getSuperblocks().size() <= superblocks);
+			CHECK(liveAllocations <= allocations);
+		}
+	}
+	CHECK(liveAllocations == 0);
+}
+
+/*
+ * A copy-on-write snapshot of one large block: each write copies aside no
+ * more than a chunk of it, the snapshot reads and iterates over what was
+ * there throughout, and the block is whole again once the head has passed
+ * and the snapshot is gone.
+ */
+static void copyOnWriteChunks()
+{
+	const size_t chunk = Buffer::copyOnWriteChunkBytes / sizeof(uint32_t);
+	Buffer::Config config;
+	config.blockCount = 1;
+	Buffer buffer(8 * chunk, config);
+
+	CHECK(writeNext(buffer, 8 * chunk) == Buffer::WriteStatus::OK);
+	Buffer::Snapshot *snapshot =
+		buffer.snapshot(buffer.ptrAt(0), buffer.ptrAt(8 * chunk));
+	size_t blocks = buffer.stats().blockCount;
+
+	std::vector<uint32_t> out(8 * chunk);
+	for (size_t round = 0; round < 16; round++) {
+		CHECK(writeNext(buffer, chunk / 2) == Buffer::WriteStatus::OK);
+		//the rest of the block waits to be copied in its own piece:
+		CHECK(buffer.stats().blockCount > blocks || round > 0);
+		CHECK(buffer.stats().blockCount <= blocks + 2);
+		CHECK(snapshot->read(0, out.data(), out.size()) == out.size());
+		for (size_t i = 0; i < out.size(); i++)
+			CHECK(out[i] == (uint32_t)i);
+	}
+
+	uint32_t expected = 0;
+	for (Buffer::Snapshot::Iterator it = snapshot->begin();
+	     it != snapshot->end(); ++it)
+		CHECK(*it == expected++);
+	CHECK(expected == 8 * chunk);
+	bool thrown = false;
+	try {
+		(void)*snapshot->end();
+	} catch (const std::out_of_range &) {
+		thrown = true;
+	}
+	CHECK(thrown);
+
+	buffer.releaseSnapshot(snapshot);
+	CHECK(writeNext(buffer, 8 * chunk) == Buffer::WriteStatus::OK);
+	CHECK(buffer.stats().blockCount == blocks);
+	checkLive(buffer);
+}
+
+/*
+ * Concurrent mode with a real writer and reader thread: the writer alternates
+ * write() and reserve()/commit() without ever being allowed to overwrite
+ * anything unread, so the reader must see every position exactly once, in
+ * order.
+ */
+static void concurrentWriterReader()
+{
+	Buffer::Config config;
+	config.concurrent = true;
+	config.blockCount = 8;
+	config.overflowPolicy = Buffer::OverflowPolicy::REJECT;
+	Buffer buffer(1024, config);
+	const uint64_t total = 1 << 21;
+
+	std::thread writer([&buffer, total]() {
+		std::vector<Buffer::Span> spans;
+		std::vector<uint32_t> data(200);
+		uint64_t pos = 0;
+		for (size_t round = 0; pos < total; round++) {
+			size_t count = std::min((uint64_t)(1 + round % 200),
+						total - pos);
+			if (round % 2 == 0) {
+				for (size_t i = 0; i < count; i++)
+					data[i] = (uint32_t)(pos + i);
+				if (buffer.write(data.data(), count) ==
+				    Buffer::WriteStatus::OK)
+					pos += count;
+				else
+					std::this_thread::yield();
+			} else {
+				size_t reserved = buffer.reserve(spans, count);
+				for (const Buffer::Span &span : spans)
+					for (size_t i = 0; i < span.length; i++)
+						span.ptr[i] = (uint32_t)pos++;
+				buffer.commit(reserved);
+				if (reserved == 0)
+					std::this_thread::yield();
+			}
+		}
+	});
+
+	std::vector<uint32_t> out(256);
+	uint64_t pos = 0;
+	while (pos < total) {
+		size_t count = buffer.read(out.data(), out.size());
+		for (size_t i = 0; i < count; i++)
+			CHECK(out[i] == (uint32_t)(pos + i));
+		pos += count;
+		if (count == 0)
+			std::this_thread::yield();
+	}
+	writer.join();
+
+	CHECK(written(buffer) == total);
+	CHECK(buffer.stats().bytesEvicted == 0);
+	CHECK(buffer.bufferHealth() == 0);
+}
+
+int main(int argc, char **argv)
+{
+	static const struct {
+		const char *name;
+		void (*run)();
+	} cases[] = {
+		{"reserveCommitGrowthRetain", reserveCommitGrowthRetain},
+		{"protectUnprotectReuse", protectUnprotectReuse},
+		{"readersAllExcluded", readersAllExcluded},
+		{"overflowIndex", overflowIndex},
+		{"leases", leases},
+		{"overflowPolicies", overflowPolicies},
+		{"compressProtected", compressProtected},
+		{"nonTrivialElements", nonTrivialElements},
+		{"growReclaimMemory", growReclaimMemory},
+		{"copyOnWriteChunks", copyOnWriteChunks},
+		{"concurrentWriterReader", concurrentWriterReader},
+	};
+
+	bool found = false;
+	for (const auto &testCase : cases) {
+		if (argc > 1 && strcmp(argv[1], testCase.name) != 0)
+			continue;
+		printf("%s\n", testCase.name);
+		testCase.run();
+		found = true;
+	}
+	if (!found) {
+		fprintf(stderr, "No such case: %s\n", argv[1]);
+		return 1;
+	}
+	return 0;
+}
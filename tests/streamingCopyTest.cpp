@@ -0,0 +1,70 @@
+/*
+ * Checks streamingCopy() against memcpy() for whichever kernel this CPU
+ * selects, across sizes either side of the vector widths and of
+ * streamingCopyThreshold, and every alignment of source and destination
+ * that changes how the head, loop and tail are split. Guard bytes either
+ * side of the destination catch stores out of bounds. Usage:
+ *
+ *	streamingCopyTest
+ */
+#include "streamingCopy.hpp"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+using namespace ReplayWorkbench;
+
+#define CHECK(condition)                                                \
+	do {                                                            \
+		if (!(condition)) {                                     \
+			fprintf(stderr, "%s:%d: check failed: %s\n",    \
+				__FILE__, __LINE__, #condition);        \
+			exit(1);                                        \
+		}                                                       \
+	} while (0)
+
+static const size_t guardBytes = 64;
+static const unsigned char guard = 0xa5;
+
+static void checkCopy(const std::vector<unsigned char> &source,
+		      size_t srcOffset, size_t destOffset, size_t bytes)
+{
+	std::vector<unsigned char> dest(destOffset + bytes + 2 * guardBytes,
+					guard);
+	unsigned char *out = dest.data() + guardBytes + destOffset;
+	streamingCopy(out, source.data() + srcOffset, bytes);
+
+	CHECK(memcmp(out, source.data() + srcOffset, bytes) == 0);
+	for (size_t i = 0; i < guardBytes + destOffset; i++)
+		CHECK(dest[i] == guard);
+	for (size_t i = guardBytes + destOffset + bytes; i < dest.size(); i++)
+		CHECK(dest[i] == guard);
+}
+
+int main()
+{
+	printf("kernel: %s\n", streamingCopyKernelName());
+
+	const size_t largest = 3 * 1024 * 1024 + 5;
+	const size_t sizes[] = {0, 1, 15, 16, 17, 31, 32, 33, 63, 64, 65, 127,
+				128, 129, 4095, 4096, streamingCopyThreshold - 1,
+				streamingCopyThreshold,
+				streamingCopyThreshold + 77, largest};
+	const size_t offsets[] = {0, 1, 7, 15, 16, 31, 32};
+
+	std::vector<unsigned char> source(largest + 32);
+	uint32_t state = 1;
+	for (unsigned char &byte : source) {
+		state = state * 1664525 + 1013904223;
+		byte = (unsigned char)(state >> 24);
+	}
+
+	for (size_t bytes : sizes)
+		for (size_t srcOffset : offsets)
+			for (size_t destOffset : offsets)
+				checkCopy(source, srcOffset, destOffset, bytes);
+	return 0;
+}
@@ -0,0 +1,249 @@
+/*
+ * Tests of the superblock memory modes, one case per run as for
+ * blockCirclebufTest: whatever mode is asked for, the memory handed back must
+ * be usable in full and freed cleanly, and a mode the system cannot provide
+ * must fall back to the heap with a warning rather than fail. Usage:
+ *
+ *	superblockMemoryTest <case>
+ */
+#include "blockCirclebuf.hpp"
+#include "superblockMemory.hpp"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#if defined(__linux__) || defined(__APPLE__)
+#include <dirent.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
+using namespace ReplayWorkbench;
+
+#define CHECK(condition)                                                \
+	do {                                                            \
+		if (!(condition)) {                                     \
+			fprintf(stderr, "%s:%d: check failed: %s\n",    \
+				__FILE__, __LINE__, #condition);        \
+			exit(1);                                        \
+		}                                                       \
+	} while (0)
+
+static const size_t hugePageSize = 2 * 1024 * 1024;
+
+static size_t liveAllocations;
+static size_t warnings;
+
+static void *countedAllocate(size_t bytes)
+{
+	liveAllocations++;
+	return malloc(bytes);
+}
+
+static void countedRelease(void *ptr)
+{
+	if (ptr)
+		liveAllocations--;
+	free(ptr);
+}
+
+static void countedLog(int level, const char *format, va_list args)
+{
+	if (level <= CORE_LOG_WARNING)
+		warnings++;
+	vfprintf(stderr, format, args);
+	fputc('\n', stderr);
+}
+
+static void installHooks()
+{
+	CoreHooks hooks = {countedAllocate, countedRelease, countedLog};
+	setCoreHooks(hooks);
+}
+
+/*
+ * Fills all of `memory' and reads it back, then frees it, checking any heap
+ * allocation behind it is returned.
+ */
+static void checkUsable(SuperblockMemory &memory, size_t bytes)
+{
+	CHECK(memory.start != NULL);
+	CHECK(memory.length >= bytes);
+	CHECK((memory.mode == SuperblockMemoryMode::HEAP) ==
+	      (liveAllocations == 1));
+
+	unsigned char *start = (unsigned char *)memory.start;
+	for (size_t i = 0; i < memory.length; i++)
+		start[i] = (unsigned char)(i * 7);
+	for (size_t i = 0; i < memory.length; i++)
+		CHECK(start[i] == (unsigned char)(i * 7));
+
+	freeSuperblockMemory(memory);
+	CHECK(memory.start == NULL);
+	CHECK(liveAllocations == 0);
+}
+
+/*
+ * Writes positions through a buffer backed by `config' and reads them back.
+ */
+static SuperblockMemoryMode checkBuffer(
+	const BlockCirclebuf<uint32_t>::Config &config)
+{
+	BlockCirclebuf<uint32_t> buffer(64 * 1024, config);
+	SuperblockMemoryMode mode = buffer.getSuperblocks()[0]->memory.mode;
+
+	std::vector<uint32_t> data(48 * 1024);
+	for (size_t round = 0; round < 4; round++) {
+		for (size_t i = 0; i < data.size(); i++)
+			data[i] = (uint32_t)(round * data.size() + i);
+		CHECK(buffer.write(data.data(), data.size()) ==
+		      BlockCirclebuf<uint32_t>::WriteStatus::OK);
+		std::vector<uint32_t> out(data.size());
+		CHECK(buffer.read(out.data(), out.size()) == out.size());
+		CHECK(out == data);
+	}
+	return mode;
+}
+
+/*
+ * Huge pages, reserved or transparent, round the length up to whole pages;
+ * wherever neither is available, and always once the address space has no
+ * room for a huge page, the memory comes from the heap instead.
+ */
+static void hugePages()
+{
+	installHooks();
+	const size_t bytes = hugePageSize + 12345;
+
+	warnings = 0;
+	SuperblockMemory memory =
+		allocateSuperblockMemory(bytes, true, false, NULL);
+	if (memory.mode == SuperblockMemoryMode::HEAP) {
+		CHECK(warnings == 1);
+		CHECK(memory.length == bytes);
+	} else {
+		CHECK(memory.mode == SuperblockMemoryMode::HUGETLB ||
+		      memory.mode ==
+			      SuperblockMemoryMode::TRANSPARENT_HUGE_PAGES);
+		CHECK(memory.length % hugePageSize == 0);
+	}
+	checkUsable(memory, bytes);
+
+	BlockCirclebuf<uint32_t>::Config config;
+	config.hugePages = true;
+	checkBuffer(config);
+	CHECK(liveAllocations == 0);
+
+#ifdef __linux__
+	//leave too little address space for any huge page mapping, but enough
+	//for a small heap allocation:
+	struct rlimit limit;
+	CHECK(getrlimit(RLIMIT_AS, &limit) == 0);
+	long pages = 0;
+	FILE *statm = fopen("/proc/self/statm", "r");
+	CHECK(statm && fscanf(statm, "%ld", &pages) == 1);
+	fclose(statm);
+	struct rlimit lowered = limit;
+	lowered.rlim_cur =
+		(rlim_t)pages * sysconf(_SC_PAGESIZE) + hugePageSize / 2;
+	CHECK(setrlimit(RLIMIT_AS, &lowered) == 0);
+
+	warnings = 0;
+	memory = allocateSuperblockMemory(4096, true, false, NULL);
+	CHECK(memory.mode == SuperblockMemoryMode::HEAP);
+	CHECK(memory.length == 4096);
+	CHECK(warnings == 1);
+	checkUsable(memory, 4096);
+
+	CHECK(setrlimit(RLIMIT_AS, &limit) == 0);
+#endif
+}
+
+#if defined(__linux__) || defined(__APPLE__)
+static size_t countEntries(const std::string &directory)
+{
+	size_t count = 0;
+	DIR *dir = opendir(directory.c_str());
+	CHECK(dir != NULL);
+	while (struct dirent *entry = readdir(dir))
+		if (strcmp(entry->d_name, ".") != 0 &&
+		    strcmp(entry->d_name, "..") != 0)
+			count++;
+	closedir(dir);
+	return count;
+}
+#endif
+
+/*
+ * A backing directory gives a mapping of a file that is already unlinked, so
+ * nothing is left behind; one that cannot be used falls back to the heap.
+ */
+static void fileBacked()
+{
+#if defined(__linux__) || defined(__APPLE__)
+	installHooks();
+	const char *tmp = getenv("TMPDIR");
+	std::string directory =
+		std::string(tmp && *tmp ? tmp : "/tmp") +
+		"/superblockMemoryTest-XXXXXX";
+	CHECK(mkdtemp(&directory[0]) != NULL);
+
+	const size_t bytes = 1024 * 1024 + 3;
+	warnings = 0;
+	SuperblockMemory memory = allocateSuperblockMemory(
+		bytes, false, false, directory.c_str());
+	CHECK(memory.mode == SuperblockMemoryMode::FILE);
+	CHECK(memory.length == bytes);
+	CHECK(warnings == 0);
+	CHECK(countEntries(directory) == 0);
+	checkUsable(memory, bytes);
+
+	BlockCirclebuf<uint32_t>::Config config;
+	config.backingDirectory = directory;
+	CHECK(checkBuffer(config) == SuperblockMemoryMode::FILE);
+	CHECK(countEntries(directory) == 0);
+
+	std::string missing = directory + "/missing";
+	memory = allocateSuperblockMemory(bytes, false, false, missing.c_str());
+	CHECK(memory.mode == SuperblockMemoryMode::HEAP);
+	CHECK(warnings == 1);
+	checkUsable(memory, bytes);
+
+	config.backingDirectory = missing;
+	CHECK(checkBuffer(config) == SuperblockMemoryMode::HEAP);
+	CHECK(liveAllocations == 0);
+
+	CHECK(rmdir(directory.c_str()) == 0);
+#else
+	printf("file-backed superblocks are not supported here\n");
+#endif
+}
+
+int main(int argc, char **argv)
+{
+	static const struct {
+		const char *name;
+		void (*run)();
+	} cases[] = {
+		{"hugePages", hugePages},
+		{"fileBacked", fileBacked},
+	};
+
+	bool found = false;
+	for (const auto &testCase : cases) {
+		if (argc > 1 && strcmp(argv[1], testCase.name) != 0)
+			continue;
+		printf("%s\n", testCase.name);
+		testCase.run();
+		found = true;
+	}
+	if (!found) {
+		fprintf(stderr, "No such case: %s\n", argv[1]);
+		return 1;
+	}
+	return 0;
+}